@@ -70,10 +70,72 @@ BLOCK_EXPORT void * _NSConcreteStackBlock[32]
 }
 #endif
 
+// Inline fast path, opt-in
+// 在包含 Block.h 之前把 BLOCK_INLINE_FAST_PATH 定义为 1，Block_copy / Block_release 会先在调用处处理最常见的情况：
+// 全局区的 block 直接返回，栈上的 block 的 release 什么也不做；
+// 已经在堆上的 block，引用计数离满还很远、release 的又不是最后一个引用时，一次 CAS 加减引用计数。
+// 只依赖 flags 中公开的位，flags 的第 16 ~ 23 位是 runtime 私有的（arena、co-allocation、biased 引用计数、
+// side table 等），只要有一位置上就交给 runtime。拷贝栈上的 block、销毁、引用计数快满了以及 CAS 失败时也交给 runtime。
+#ifndef BLOCK_INLINE_FAST_PATH
+#define BLOCK_INLINE_FAST_PATH 0
+#endif
+
+#if BLOCK_INLINE_FAST_PATH && defined(__GNUC__)
+
+#define _BLOCK_INLINE_REFCOUNT_MASK  0xfffe
+#define _BLOCK_INLINE_REFCOUNT_LIMIT 0x8000     // runtime 从这里开始考虑把引用计数挪到 side table 中
+#define _BLOCK_INLINE_RUNTIME_BITS   0x00ff0001 // BLOCK_DEALLOCATING 和 runtime 私有的位
+#define _BLOCK_INLINE_NEEDS_FREE     (1 << 24)
+#define _BLOCK_INLINE_IS_GC          (1 << 27)
+#define _BLOCK_INLINE_IS_GLOBAL      (1 << 28)
+
+// Block_layout 开头的两个字段
+struct _Block_inline_header {
+    void *isa;
+    volatile int flags;
+};
+
+static __inline__ __attribute__((__always_inline__)) void *_Block_copy_inline(const void *aBlock) {
+    if (aBlock) {
+        volatile int *flags = &((struct _Block_inline_header *)aBlock)->flags;
+        int old_value = *flags;
+        if (old_value & _BLOCK_INLINE_IS_GLOBAL) return (void *)aBlock;
+        if ((old_value & (_BLOCK_INLINE_NEEDS_FREE|_BLOCK_INLINE_IS_GC|_BLOCK_INLINE_RUNTIME_BITS)) == _BLOCK_INLINE_NEEDS_FREE
+            && (old_value & _BLOCK_INLINE_REFCOUNT_MASK) < _BLOCK_INLINE_REFCOUNT_LIMIT
+            && __atomic_compare_exchange_n(flags, &old_value, old_value + 2, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return (void *)aBlock;
+        }
+    }
+    return _Block_copy(aBlock);
+}
+
+static __inline__ __attribute__((__always_inline__)) void _Block_release_inline(const void *aBlock) {
+    if (!aBlock) return;
+    volatile int *flags = &((struct _Block_inline_header *)aBlock)->flags;
+    int old_value = *flags;
+    if (old_value & _BLOCK_INLINE_IS_GLOBAL) return;
+    if (!(old_value & (_BLOCK_INLINE_NEEDS_FREE|_BLOCK_INLINE_IS_GC))) return; // 栈上的 block
+    // 不是最后一个引用，减完以后也不需要从 side table 中借回引用计数
+    if ((old_value & (_BLOCK_INLINE_NEEDS_FREE|_BLOCK_INLINE_IS_GC|_BLOCK_INLINE_RUNTIME_BITS)) == _BLOCK_INLINE_NEEDS_FREE
+        && (old_value & _BLOCK_INLINE_REFCOUNT_MASK) > 2
+        && (old_value & _BLOCK_INLINE_REFCOUNT_MASK) < _BLOCK_INLINE_REFCOUNT_LIMIT
+        && __atomic_compare_exchange_n(flags, &old_value, old_value - 2, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        return;
+    }
+    _Block_release(aBlock);
+}
+
+#endif
+
 // Type correct macros
 
+#if BLOCK_INLINE_FAST_PATH && defined(__GNUC__)
+#define Block_copy(...) ((__typeof(__VA_ARGS__))_Block_copy_inline((const void *)(__VA_ARGS__)))
+#define Block_release(...) _Block_release_inline((const void *)(__VA_ARGS__))
+#else
 #define Block_copy(...) ((__typeof(__VA_ARGS__))_Block_copy((const void *)(__VA_ARGS__)))
 #define Block_release(...) _Block_release((const void *)(__VA_ARGS__))
+#endif
 
 
 #endif
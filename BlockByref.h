@@ -0,0 +1,70 @@
+/*
+ *  BlockByref.h
+ *
+ * Copyright (c) 2008-2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ *
+ */
+
+#ifndef _BlockByref_H_
+#define _BlockByref_H_
+
+#if !defined(__cplusplus) || __cplusplus < 201103L
+#error "BlockByref.h requires C++11"
+#endif
+
+#include <Block_private.h>
+#include <stddef.h>
+
+// 访问 __block 变量时不经过 forwarding，见 Block_private.h 中的 _Block_byref_resolve()。
+// ByrefAccessor<T> 记住 byref 和变量在 byref 中的偏移，byref 还在栈上时照常经过 forwarding；
+// 一旦发现它已经被提升到堆上，就缓存堆上变量的地址，之后的访问只有一次 load。
+//
+//   ByrefAccessor<int> count(&byref, &byref.count);   // 比如 TestBlock 中改写出来的 __Block_byref_xxx
+//   ... Block_copy 了引入它的 block 以后 ...
+//   int *p = count.resolve();                          // 热循环外面解析一次
+//   for (...) ++*p;
+//
+// 缓存的地址在 byref 释放以前有效，调用者要持有引入它的 block。
+
+namespace libclosure {
+
+template <class T>
+class ByrefAccessor {
+public:
+    // byref 是 __block 变量的 Block_byref（栈上或堆上），variable 是变量在这个 byref 中的地址
+    ByrefAccessor(void *byref, T *variable) noexcept
+        : _byref((struct Block_byref *)byref),
+          _offset((char *)variable - (char *)byref),
+          _resolved(nullptr) { }
+
+    // 已经提升到堆上时返回堆上变量的地址并缓存，否则返回 nullptr
+    T *resolve() noexcept {
+        if (!_resolved) {
+            void *heap = _Block_byref_resolve(_byref);
+            if (heap) _resolved = (T *)((char *)heap + _offset);
+        }
+        return _resolved;
+    }
+
+    // 当前的变量，还在栈上时经过 forwarding
+    T &get() noexcept {
+        if (T *resolved = resolve()) return *resolved;
+        return *(T *)((char *)_byref->forwarding + _offset);
+    }
+
+    T &operator*() noexcept { return get(); }
+    T *operator->() noexcept { return &get(); }
+
+    bool isResolved() const noexcept { return _resolved != nullptr; }
+
+private:
+    struct Block_byref *_byref;
+    ptrdiff_t _offset;
+    T *_resolved;
+};
+
+} // namespace libclosure
+
+#endif
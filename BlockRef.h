@@ -0,0 +1,340 @@
+/*
+ *  BlockRef.h
+ *
+ * Copyright (c) 2008-2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ *
+ */
+
+#ifndef _BlockRef_H_
+#define _BlockRef_H_
+
+#if !defined(__cplusplus) || __cplusplus < 201103L
+#error "BlockRef.h requires C++11"
+#endif
+
+#include <Block.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// C++ 中持有 block 的 RAII 句柄。
+// BlockRef<R(Args...)> 总是持有一个堆上（或全局区）的 block 的一个引用：
+//   - 从 block 构造时 Block_copy 一次，栈上的 block 在这里拷贝到堆上；
+//   - 拷贝构造 / 拷贝赋值是对堆上的 block 做一次 Block_copy，即只加一次引用计数；
+//   - 移动构造 / 移动赋值只是把指针交给对方，不调用 Block_copy / Block_release；
+//   - 析构时 Block_release 一次。
+// 按值传递时用 std::move 就不会产生引用计数的原子操作。
+// operator() 直接从 block 中取出 invoke 函数指针来调用，第一个参数是 block 自己。
+// 在包含本文件之前定义 BLOCK_INLINE_FAST_PATH，引用计数的增减也会走 Block.h 中的内联快速路径。
+//
+// StackBlock<R(Args...), F> 在没有 -fblocks 的 C++ 代码中用 lambda 拼出一个真正的栈上的 block，
+// 可以直接传给接收 block 的 C API，见文件末尾。
+
+namespace libclosure {
+
+// Block_layout 开头的几个字段，Block_private.h 不是公开的头文件
+struct _BlockRefHeader {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void *invoke;   // 实际是 R (*)(void *block, Args...)
+    const void *descriptor;
+};
+
+template <class Signature> class BlockRef;
+
+template <class R, class... Args>
+class BlockRef<R(Args...)> {
+public:
+    BlockRef() noexcept : _block(nullptr) { }
+    BlockRef(std::nullptr_t) noexcept : _block(nullptr) { }
+
+#if __BLOCKS__
+    // 从 block 构造，栈上的 block 会被拷贝到堆上
+    BlockRef(R (^block)(Args...)) : _block(Block_copy((void *)block)) { }
+#endif
+
+    // 接管一个已经 Block_copy 过的 block 的引用，不再加引用计数
+    static BlockRef adopt(const void *block) noexcept {
+        BlockRef ref;
+        ref._block = const_cast<void *>(block);
+        return ref;
+    }
+
+    // 持有一个 block 的新引用，栈上的 block 会被拷贝到堆上
+    static BlockRef retain(const void *block) {
+        return adopt(Block_copy(const_cast<void *>(block)));
+    }
+
+    BlockRef(const BlockRef &other) : _block(Block_copy(other._block)) { }
+
+    BlockRef(BlockRef &&other) noexcept : _block(other._block) {
+        other._block = nullptr;
+    }
+
+    ~BlockRef() {
+        if (_block) Block_release(_block);
+    }
+
+    BlockRef &operator=(const BlockRef &other) {
+        if (_block != other._block) {
+            // 先加后减，other 和 *this 持有同一个 block 的另一个引用时也不会提前销毁
+            void *block = Block_copy(other._block);
+            reset();
+            _block = block;
+        }
+        return *this;
+    }
+
+    BlockRef &operator=(BlockRef &&other) noexcept {
+        if (this != &other) {
+            reset();
+            _block = other._block;
+            other._block = nullptr;
+        }
+        return *this;
+    }
+
+    BlockRef &operator=(std::nullptr_t) noexcept {
+        reset();
+        return *this;
+    }
+
+    R operator()(Args... args) const {
+        R (*invoke)(void *, Args...) = reinterpret_cast<R (*)(void *, Args...)>(((_BlockRefHeader *)_block)->invoke);
+        return invoke(_block, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept { return _block != nullptr; }
+
+    // 持有的 block，引用仍归 BlockRef 所有
+    void *get() const noexcept { return _block; }
+
+#if __BLOCKS__
+    R (^block() const noexcept)(Args...) { return (R (^)(Args...))_block; }
+#endif
+
+    // 交出持有的引用，调用者负责 Block_release
+    void *release() noexcept {
+        void *block = _block;
+        _block = nullptr;
+        return block;
+    }
+
+    void reset() noexcept {
+        if (_block) {
+            void *block = _block;
+            _block = nullptr;
+            Block_release(block);
+        }
+    }
+
+    void swap(BlockRef &other) noexcept {
+        void *block = _block;
+        _block = other._block;
+        other._block = block;
+    }
+
+    friend bool operator==(const BlockRef &a, const BlockRef &b) noexcept { return a._block == b._block; }
+    friend bool operator!=(const BlockRef &a, const BlockRef &b) noexcept { return a._block != b._block; }
+
+private:
+    void *_block;
+};
+
+template <class R, class... Args>
+inline void swap(BlockRef<R(Args...)> &a, BlockRef<R(Args...)> &b) noexcept {
+    a.swap(b);
+}
+
+/****************************************************************************
+ Lambda → block
+
+ StackBlock<R(Args...), F> 的内存布局和编译器生成的栈上的 block 一样：Block_layout 的头部后面跟着 lambda。
+ isa 是 _NSConcreteStackBlock，descriptor 是每个 StackBlock 类型一份的常量，编译期生成，
+ 里面有 size、copy/dispose helper 和签名字符串。StackBlock 本身不分配内存，只有 _Block_copy 会。
+
+ - lambda 可以平凡地拷贝和析构时，没有 helper，拷贝到堆上就是按位拷贝；
+ - 否则设置 BLOCK_HAS_COPY_DISPOSE 和 BLOCK_HAS_CTOR，copy helper 在堆上的 block 中拷贝构造 lambda，
+   dispose helper 析构它。栈上的 block 可能被拷贝多次，所以这里用拷贝构造而不是移动构造。
+
+ 签名按 Objective-C 的类型编码生成，不带偏移，比如 int(int) 是 "i@?i"。
+ 不认识的类型（结构体、类）编码为 "?"。
+*****************************************************************************/
+
+// Block_private.h 中的 flags，这里不能包含它
+enum {
+    _BLOCK_REF_HAS_COPY_DISPOSE = (1 << 25),
+    _BLOCK_REF_HAS_CTOR =         (1 << 26),
+    _BLOCK_REF_HAS_SIGNATURE =    (1 << 30)
+};
+
+// Block_descriptor_1 + Block_descriptor_2 + Block_descriptor_3
+struct _BlockDescriptorWithHelpers {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+    const char *signature;
+    const char *layout;
+};
+
+// Block_descriptor_1 + Block_descriptor_3
+struct _BlockDescriptorPlain {
+    uintptr_t reserved;
+    uintptr_t size;
+    const char *signature;
+    const char *layout;
+};
+
+// 编译期拼接的类型编码
+template <char... C> struct _BlockEncoding {
+    static constexpr char value[sizeof...(C) + 1] = { C..., '\0' };
+};
+template <char... C> constexpr char _BlockEncoding<C...>::value[sizeof...(C) + 1];
+
+template <class... E> struct _BlockEncodingJoin;
+template <char... A> struct _BlockEncodingJoin<_BlockEncoding<A...>> {
+    typedef _BlockEncoding<A...> type;
+};
+template <char... A, char... B, class... Rest> struct _BlockEncodingJoin<_BlockEncoding<A...>, _BlockEncoding<B...>, Rest...> {
+    typedef typename _BlockEncodingJoin<_BlockEncoding<A..., B...>, Rest...>::type type;
+};
+
+template <class T> struct _BlockTypeEncoding { typedef _BlockEncoding<'?'> type; };
+template <class T> struct _BlockTypeEncoding<const T> : _BlockTypeEncoding<T> { };
+template <class T> struct _BlockTypeEncoding<volatile T> : _BlockTypeEncoding<T> { };
+template <class T> struct _BlockTypeEncoding<const volatile T> : _BlockTypeEncoding<T> { };
+template <class T> struct _BlockTypeEncoding<T *> {
+    typedef typename _BlockEncodingJoin<_BlockEncoding<'^'>, typename _BlockTypeEncoding<T>::type>::type type;
+};
+// 引用按指针编码
+template <class T> struct _BlockTypeEncoding<T &> : _BlockTypeEncoding<T *> { };
+template <class T> struct _BlockTypeEncoding<T &&> : _BlockTypeEncoding<T *> { };
+#define _BLOCK_TYPE_ENCODING(T, ...) \
+    template <> struct _BlockTypeEncoding<T> { typedef _BlockEncoding<__VA_ARGS__> type; };
+_BLOCK_TYPE_ENCODING(void, 'v')
+_BLOCK_TYPE_ENCODING(bool, 'B')
+_BLOCK_TYPE_ENCODING(char, 'c')
+_BLOCK_TYPE_ENCODING(signed char, 'c')
+_BLOCK_TYPE_ENCODING(unsigned char, 'C')
+_BLOCK_TYPE_ENCODING(short, 's')
+_BLOCK_TYPE_ENCODING(unsigned short, 'S')
+_BLOCK_TYPE_ENCODING(int, 'i')
+_BLOCK_TYPE_ENCODING(unsigned int, 'I')
+_BLOCK_TYPE_ENCODING(long, sizeof(long) == 8 ? 'q' : 'l')
+_BLOCK_TYPE_ENCODING(unsigned long, sizeof(long) == 8 ? 'Q' : 'L')
+_BLOCK_TYPE_ENCODING(long long, 'q')
+_BLOCK_TYPE_ENCODING(unsigned long long, 'Q')
+_BLOCK_TYPE_ENCODING(float, 'f')
+_BLOCK_TYPE_ENCODING(double, 'd')
+_BLOCK_TYPE_ENCODING(long double, 'D')
+_BLOCK_TYPE_ENCODING(char *, '*')
+_BLOCK_TYPE_ENCODING(const char *, '*')
+_BLOCK_TYPE_ENCODING(void *, '^', 'v')
+_BLOCK_TYPE_ENCODING(const void *, 'r', '^', 'v')
+#undef _BLOCK_TYPE_ENCODING
+#if __BLOCKS__
+template <class R, class... Args> struct _BlockTypeEncoding<R (^)(Args...)> { typedef _BlockEncoding<'@', '?'> type; };
+#endif
+
+template <class R, class... Args> struct _BlockSignature {
+    typedef typename _BlockEncodingJoin<typename _BlockTypeEncoding<R>::type, _BlockEncoding<'@', '?'>,
+                                        typename _BlockTypeEncoding<Args>::type...>::type type;
+};
+
+template <class Block, bool trivial = Block::_trivial> struct _BlockDescriptors;
+
+template <class Block> struct _BlockDescriptors<Block, false> {
+    static constexpr int flags = _BLOCK_REF_HAS_COPY_DISPOSE | _BLOCK_REF_HAS_CTOR | _BLOCK_REF_HAS_SIGNATURE;
+    static constexpr _BlockDescriptorWithHelpers value = {
+        0, sizeof(Block), &Block::_copy, &Block::_dispose, Block::_signature::value, nullptr
+    };
+};
+template <class Block> constexpr _BlockDescriptorWithHelpers _BlockDescriptors<Block, false>::value;
+
+template <class Block> struct _BlockDescriptors<Block, true> {
+    static constexpr int flags = _BLOCK_REF_HAS_SIGNATURE;
+    static constexpr _BlockDescriptorPlain value = {
+        0, sizeof(Block), Block::_signature::value, nullptr
+    };
+};
+template <class Block> constexpr _BlockDescriptorPlain _BlockDescriptors<Block, true>::value;
+
+template <class Signature, class F> class StackBlock;
+
+template <class R, class... Args, class F>
+class StackBlock<R(Args...), F> {
+    static_assert(std::is_copy_constructible<F>::value, "a block's captures must be copy constructible");
+
+public:
+    explicit StackBlock(const F &fn) : _fn(fn) { _init(); }
+    explicit StackBlock(F &&fn) : _fn(std::move(fn)) { _init(); }
+
+    // 只在 block 交出去之前移动，比如从 makeBlock() 返回
+    StackBlock(StackBlock &&other) : _fn(std::move(other._fn)) { _init(); }
+    StackBlock(const StackBlock &) = delete;
+    StackBlock &operator=(const StackBlock &) = delete;
+
+    // 栈上的 block，拷贝到堆上的那些由 _Block_release 负责
+    ~StackBlock() = default;
+
+    R operator()(Args... args) const {
+        return _invoke(const_cast<StackBlock *>(this), std::forward<Args>(args)...);
+    }
+
+    // block 的地址，可以传给接收 block 的 C API
+    void *get() const noexcept { return const_cast<StackBlock *>(this); }
+
+#if __BLOCKS__
+    R (^block() const noexcept)(Args...) { return (R (^)(Args...))get(); }
+#endif
+
+    // 拷贝到堆上，得到一个引用
+    BlockRef<R(Args...)> copy() const { return BlockRef<R(Args...)>::retain(get()); }
+
+private:
+    template <class, bool> friend struct _BlockDescriptors;
+
+    static constexpr bool _trivial = std::is_trivially_copyable<F>::value && std::is_trivially_destructible<F>::value;
+    typedef typename _BlockSignature<R, Args...>::type _signature;
+
+    void _init() {
+        _header.isa = _NSConcreteStackBlock;
+        _header.flags = _BlockDescriptors<StackBlock>::flags;
+        _header.reserved = 0;
+        _header.invoke = reinterpret_cast<void *>(&StackBlock::_invoke);
+        _header.descriptor = &_BlockDescriptors<StackBlock>::value;
+    }
+
+    static R _invoke(void *block, Args... args) {
+        return static_cast<StackBlock *>(block)->_fn(std::forward<Args>(args)...);
+    }
+
+    // dst 已经是 src 按位拷贝的结果，在原处重新构造 lambda
+    static void _copy(void *dst, const void *src) {
+        ::new ((void *)&static_cast<StackBlock *>(dst)->_fn) F(static_cast<const StackBlock *>(src)->_fn);
+    }
+
+    static void _dispose(const void *block) {
+        static_cast<StackBlock *>(const_cast<void *>(block))->_fn.~F();
+    }
+
+    _BlockRefHeader _header;
+    F _fn;
+};
+
+// auto block = libclosure::makeBlock<int(int)>([&](int x) { return x + y; });
+// c_api_taking_block(block.get());
+template <class Signature, class F>
+inline StackBlock<Signature, typename std::decay<F>::type> makeBlock(F &&fn) {
+    return StackBlock<Signature, typename std::decay<F>::type>(std::forward<F>(fn));
+}
+
+} // namespace libclosure
+
+#endif
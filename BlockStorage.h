@@ -0,0 +1,104 @@
+/*
+ *  BlockStorage.h
+ *
+ * Copyright (c) 2008-2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ *
+ */
+
+#ifndef _BlockStorage_H_
+#define _BlockStorage_H_
+
+#include <BlockRef.h>
+#include <Block_private.h>
+
+// Block_storage_t 的 C++ 值类型，见 Block_private.h 中的 Small-buffer storage。
+// BlockStorage<R(Args...)> 持有一个 block：栈上的小 block 拷贝到对象内部的 buffer 中，不分配内存，
+// 其他的 block 持有一个堆上的引用。
+//   - 拷贝：buffer 中的 block 再拷贝到新的 buffer 中（调用 copy helper），堆上的 block 加一次引用计数；
+//   - 移动：堆上的 block 只是交出指针；buffer 中的 block 拷贝到新的 buffer 中，再销毁原来的那一份，仍然不分配内存；
+//   - share()：需要交给别人长期持有时，得到一个 BlockRef，buffer 中的 block 这时才提升到堆上。
+
+namespace libclosure {
+
+template <class Signature> class BlockStorage;
+
+template <class R, class... Args>
+class BlockStorage<R(Args...)> {
+public:
+    BlockStorage() noexcept { _storage.block = nullptr; }
+    BlockStorage(std::nullptr_t) noexcept { _storage.block = nullptr; }
+
+    // 任意的 block 指针：栈上的 block 放得下时拷贝进来，否则 Block_copy
+    explicit BlockStorage(const void *block) { _Block_storage_init(&_storage, block); }
+
+#if __BLOCKS__
+    BlockStorage(R (^block)(Args...)) { _Block_storage_init(&_storage, (const void *)block); }
+#endif
+
+    template <class F>
+    BlockStorage(const StackBlock<R(Args...), F> &block) { _Block_storage_init(&_storage, block.get()); }
+
+    BlockStorage(const BlockRef<R(Args...)> &ref) { _Block_storage_init(&_storage, ref.get()); }
+
+    BlockStorage(const BlockStorage &other) { _Block_storage_init(&_storage, other._storage.block); }
+
+    BlockStorage(BlockStorage &&other) { _take(other); }
+
+    ~BlockStorage() { _Block_storage_destroy(&_storage); }
+
+    BlockStorage &operator=(const BlockStorage &other) {
+        if (this != &other) {
+            _Block_storage_destroy(&_storage);
+            _Block_storage_init(&_storage, other._storage.block);
+        }
+        return *this;
+    }
+
+    BlockStorage &operator=(BlockStorage &&other) {
+        if (this != &other) {
+            _Block_storage_destroy(&_storage);
+            _take(other);
+        }
+        return *this;
+    }
+
+    BlockStorage &operator=(std::nullptr_t) {
+        _Block_storage_destroy(&_storage);
+        return *this;
+    }
+
+    R operator()(Args... args) const {
+        R (*invoke)(void *, Args...) = reinterpret_cast<R (*)(void *, Args...)>(((_BlockRefHeader *)_storage.block)->invoke);
+        return invoke(_storage.block, std::forward<Args>(args)...);
+    }
+
+    explicit operator bool() const noexcept { return _storage.block != nullptr; }
+
+    // block 的地址，可能在对象内部，只在对象活着、没被修改时有效
+    void *get() const noexcept { return _storage.block; }
+
+    bool isInline() const noexcept { return _storage.block == (void *)_storage.buffer; }
+
+    // 堆上的一个引用，可以比 BlockStorage 活得更久
+    BlockRef<R(Args...)> share() { return BlockRef<R(Args...)>::adopt(_Block_storage_share(&_storage)); }
+
+private:
+    void _take(BlockStorage &other) {
+        if (other.isInline()) {
+            _Block_storage_init(&_storage, other._storage.block);
+            _Block_storage_destroy(&other._storage);
+        }
+        else {
+            _storage = other._storage;
+            other._storage.block = nullptr;
+        }
+    }
+
+    Block_storage_t _storage;
+};
+
+} // namespace libclosure
+
+#endif
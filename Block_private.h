@@ -31,6 +31,10 @@ extern "C" { // 如果是 C++，就指定下面的数据结构和函数按照 C
 enum {
     BLOCK_DEALLOCATING =      (0x0001),  // runtime  正在 dealloc
     BLOCK_REFCOUNT_MASK =     (0xfffe),  // runtime  引用计数掩码，即从第 1 ~ 15 位是用来存引用计数的，第 0 位上面已经被用了
+    BLOCK_IS_ARENA =          (1 << 16), // runtime  在 arena 中，不做引用计数，随 arena 一起销毁，见 _Block_copy_in_arena()
+    BLOCK_COALLOCATED =       (1 << 17), // runtime  和它的 byref 放在同一块内存中，见 _Block_use_byref_coallocation()
+    BLOCK_REFCOUNT_BIASED =   (1 << 18), // runtime  拷贝它的线程的引用计数记在 reserved 的高位中，见 _Block_use_biased_refcounts()
+    BLOCK_REFCOUNT_SPILLED =  (1 << 20), // runtime  引用计数有一部分存在 side table 中，见 latching_incr_int()
     BLOCK_NEEDS_FREE =        (1 << 24), // runtime  需要释放，即它现在在堆上
     BLOCK_HAS_COPY_DISPOSE =  (1 << 25), // compiler 是否有 copy / dispose 函数，copy 和 dispose 在 desc 中
     BLOCK_HAS_CTOR =          (1 << 26), // compiler: helpers have C++ code block 有 C++ 的构造器
@@ -75,7 +79,8 @@ struct Block_descriptor_3 {
 struct Block_layout {
     void *isa;
     volatile int32_t flags; // contains ref count 包括引用计数在内的 flag，详情见本文件顶部
-    int32_t reserved; // 保留，不知道有没有大用
+    int32_t reserved; // 保留。堆上的 block 在低 16 位记录自己是从 slab 的哪个 size class 分配的，
+                      // 高位是 biased refcount 的 local count，见 runtime.c
     void (*invoke)(void *, ...); // block 对应的函数指针
     struct Block_descriptor_1 *descriptor; // desc 数组，第一个元素是 Block_descriptor_1，
                                            // 后面还有 Block_descriptor_2 、Block_descriptor_3
@@ -93,6 +98,7 @@ enum {
     
     // BLOCK_DEALLOCATING =      (0x0001),  // runtime
     // BLOCK_REFCOUNT_MASK =     (0xfffe),  // runtime
+    // BLOCK_REFCOUNT_SPILLED =  (1 << 20), // runtime
 
     BLOCK_BYREF_LAYOUT_MASK =       (0xf << 28), // compiler layout 的掩码，即下面这几个 layout 在第 28~31 位
     BLOCK_BYREF_LAYOUT_EXTENDED =   (  1 << 28), // compiler 扩展布局 28~31位：0b0001
@@ -105,8 +111,13 @@ enum {
 
     BLOCK_BYREF_HAS_COPY_DISPOSE =  (  1 << 25), // compiler 是否有 copy / dispose 函数
     BLOCK_BYREF_NEEDS_FREE =        (  1 << 24), // runtime  是否需要被 free
+
+    BLOCK_BYREF_SLAB_CLASS_MASK =   (0xf << 16), // runtime  堆上的 byref 是从 byref heap 的哪个 size class 分配的，0 表示 malloc
+    BLOCK_BYREF_COALLOCATED =       (  1 << 21), // runtime  和拷贝它的 block 放在同一块内存中
 };
 
+#define BLOCK_BYREF_SLAB_CLASS_SHIFT 16
+
 struct Block_byref { // 包装被引用的外部变量的结构体，结构与 __Block_byref_outerVar_0 一致
     void *isa;
     struct Block_byref *forwarding; // 堆中的 byref 的 forwarding 指向的是自己，
@@ -215,6 +226,86 @@ BLOCK_EXPORT void _Block_object_assign(void *destAddr, const void *object, const
 // runtime 入口。在 dispose helper 程序中 dispose 对象时，被编译器调用。见 TestBlock 中的 __main_block_dispose_1() 函数
 BLOCK_EXPORT void _Block_object_dispose(const void *object, const int flags);
 
+// Flag-specialized entry points
+// 和 flags 固定的 _Block_object_assign() / _Block_object_dispose() 一样，但是不用再解码 flags
+BLOCK_EXPORT void _Block_object_assign_object(void *destAddr, const void *object);         // BLOCK_FIELD_IS_OBJECT
+BLOCK_EXPORT void _Block_object_assign_block(void *destAddr, const void *object);          // BLOCK_FIELD_IS_BLOCK
+BLOCK_EXPORT void _Block_object_assign_byref(void *destAddr, const void *object);          // BLOCK_FIELD_IS_BYREF
+BLOCK_EXPORT void _Block_object_assign_weak_byref(void *destAddr, const void *object);     // BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK
+BLOCK_EXPORT void _Block_object_assign_byref_field(void *destAddr, const void *object);    // BLOCK_BYREF_CALLER | OBJECT 或 BLOCK
+BLOCK_EXPORT void _Block_object_assign_weak_byref_field(void *destAddr, const void *object); // BLOCK_BYREF_CALLER | OBJECT 或 BLOCK | WEAK
+BLOCK_EXPORT void _Block_object_dispose_object(const void *object);                        // BLOCK_FIELD_IS_OBJECT
+BLOCK_EXPORT void _Block_object_dispose_block(const void *object);                         // BLOCK_FIELD_IS_BLOCK
+BLOCK_EXPORT void _Block_object_dispose_byref(const void *object);                         // BLOCK_FIELD_IS_BYREF，可以带 BLOCK_FIELD_IS_WEAK
+
+// 手写的 copy/dispose helper 可以用这两个代替 _Block_object_assign() / _Block_object_dispose()：
+// flags 是编译时常量时直接调用上面对应的入口（BLOCK_BYREF_CALLER 的 dispose 什么也不做），否则调用通用的入口
+#if defined(__GNUC__)
+static __inline__ __attribute__((__always_inline__))
+void _Block_object_assign_inline(void *destAddr, const void *object, const int flags) {
+    if (!__builtin_constant_p(flags)) {
+        _Block_object_assign(destAddr, object, flags);
+        return;
+    }
+    switch (flags & BLOCK_ALL_COPY_DISPOSE_FLAGS) {
+      case BLOCK_FIELD_IS_OBJECT:
+        _Block_object_assign_object(destAddr, object);
+        return;
+      case BLOCK_FIELD_IS_BLOCK:
+        _Block_object_assign_block(destAddr, object);
+        return;
+      case BLOCK_FIELD_IS_BYREF:
+        _Block_object_assign_byref(destAddr, object);
+        return;
+      case BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK:
+        _Block_object_assign_weak_byref(destAddr, object);
+        return;
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT:
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK:
+        _Block_object_assign_byref_field(destAddr, object);
+        return;
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT | BLOCK_FIELD_IS_WEAK:
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK  | BLOCK_FIELD_IS_WEAK:
+        _Block_object_assign_weak_byref_field(destAddr, object);
+        return;
+      default:
+        _Block_object_assign(destAddr, object, flags);
+        return;
+    }
+}
+
+static __inline__ __attribute__((__always_inline__))
+void _Block_object_dispose_inline(const void *object, const int flags) {
+    if (!__builtin_constant_p(flags)) {
+        _Block_object_dispose(object, flags);
+        return;
+    }
+    switch (flags & BLOCK_ALL_COPY_DISPOSE_FLAGS) {
+      case BLOCK_FIELD_IS_OBJECT:
+        _Block_object_dispose_object(object);
+        return;
+      case BLOCK_FIELD_IS_BLOCK:
+        _Block_object_dispose_block(object);
+        return;
+      case BLOCK_FIELD_IS_BYREF:
+      case BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK:
+        _Block_object_dispose_byref(object);
+        return;
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT:
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK:
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT | BLOCK_FIELD_IS_WEAK:
+      case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK  | BLOCK_FIELD_IS_WEAK:
+        return;
+      default:
+        _Block_object_dispose(object, flags);
+        return;
+    }
+}
+#else
+#define _Block_object_assign_inline(destAddr, object, flags) _Block_object_assign(destAddr, object, flags)
+#define _Block_object_dispose_inline(object, flags) _Block_object_dispose(object, flags)
+#endif
+
 
 // Other support functions
 
@@ -313,12 +404,141 @@ typedef struct Block_callbacks_RR Block_callbacks_RR;
 
 BLOCK_EXPORT void _Block_use_RR2(const Block_callbacks_RR *callbacks);
 
+// 之后 _Block_use_GC / _Block_use_GC5 / _Block_use_RR / _Block_use_RR2 都被忽略，callout 不会再变。
+// 没有装 callout 就 seal 时，拷贝和销毁的路径上不会再有间接调用。
+BLOCK_EXPORT void _Block_seal_callouts(void);
+
 // make a collectable GC heap based Block.  Not useful under non-GC.
 BLOCK_EXPORT void *_Block_copy_collectable(const void *aBlock);
 
 // thread-unsafe diagnostic
 BLOCK_EXPORT const char *_Block_dump(const void *block);
 
+// 打开后，带扩展布局的栈上 block 第一次被拷贝时，它同时拷贝到堆上的 __block 变量和 block 共用一次分配。
+// byref 的生命周期单独计算，整块内存在 block 和这些 byref 都释放后才被回收。默认关闭。
+BLOCK_EXPORT void _Block_use_byref_coallocation(bool enabled);
+
+// Pluggable allocator for non-GC heap blocks and byrefs.
+// 非 GC 下，堆上的 block 和 __block 变量默认从内置的 slab heap 分配，
+// 装上自定义的分配器后全部改为从它分配。必须在第一次拷贝 block 之前调用。
+struct Block_callbacks_allocator {
+    size_t  size;                   // size == sizeof(struct Block_callbacks_allocator)
+    void   *context;                // 原样传给下面的回调
+    // kind 是 BLOCK_HEAP_BLOCKS 或 BLOCK_HEAP_BYREFS
+    void *(*alloc)(size_t size, int kind, void *context);
+    void  (*free)(void *ptr, int kind, void *context);
+    // 可选。不为 NULL 时代替 free 被调用，size 是分配时要求的大小
+    void  (*free_sized)(void *ptr, size_t size, int kind, void *context);
+};
+typedef struct Block_callbacks_allocator Block_callbacks_allocator;
+
+BLOCK_EXPORT void _Block_use_allocator(const Block_callbacks_allocator *callbacks);
+
+// Arena-scoped copies.
+// 把 block 拷贝到 arena 中，arena 销毁时统一调用 dispose helper 并释放内存。
+// arena 中的 block 不做引用计数，_Block_copy 直接返回它本身，_Block_release 什么都不做，
+// 所以它们不能比 arena 活得更久。arena 不是线程安全的。
+typedef struct Block_arena *Block_arena_t;
+
+// buffer 不为 NULL 时，arena 建在调用者提供的这块 16 字节对齐的内存中，size 是它的大小，
+// 放不下时再 malloc 新的 chunk；buffer 为 NULL 时，size 是每个 chunk 的大小，0 表示默认值。
+BLOCK_EXPORT Block_arena_t _Block_arena_create(void *buffer, size_t size);
+
+// 返回值归 arena 所有，不要对它调用 Block_release
+BLOCK_EXPORT void *_Block_copy_in_arena(const void *aBlock, Block_arena_t arena);
+
+// 调用 arena 中所有 block 的 dispose helper，然后释放所有内存
+BLOCK_EXPORT void _Block_arena_destroy(Block_arena_t arena);
+
+// Small-buffer storage.
+// 持有一个 block 的值类型，通常嵌在调用者的结构体中（比如连接对象中的 completion handler）。
+// 栈上的 block 放得进 buffer 时就拷贝到 buffer 中（调用 copy helper），不分配内存；
+// 放不下的、已经在堆上的 block 和 GC 下的 block 持有一个 Block_copy 得到的引用。
+// block 字段可以直接调用；buffer 中的 block 看起来像栈上的 block，对它 Block_copy 会得到堆上的拷贝，
+// Block_release 什么也不做。block 可能指向 storage 自己，所以 Block_storage_t 不能按位拷贝或移动，
+// 要拷贝时用另一个 storage 的 block 字段 _Block_storage_init。
+#define BLOCK_STORAGE_SIZE 64
+
+typedef struct Block_storage {
+    void *block;    // NULL、buffer 或者堆上的 block
+    void *reserved;
+    uint64_t buffer[BLOCK_STORAGE_SIZE / sizeof(uint64_t)] __attribute__((aligned(16)));
+} Block_storage_t;
+
+// storage 之前的内容被忽略，aBlock 可以为 NULL
+BLOCK_EXPORT void _Block_storage_init(Block_storage_t *storage, const void *aBlock);
+
+// 返回 storage 中的 block 的一个堆上的引用，调用者负责 Block_release。
+// buffer 中的 block 先被提升到堆上，之后 storage 持有堆上的这个 block。
+BLOCK_EXPORT void *_Block_storage_share(Block_storage_t *storage);
+
+// buffer 中的 block 调用 dispose helper，堆上的 block release 一次，之后 storage 为空
+BLOCK_EXPORT void _Block_storage_destroy(Block_storage_t *storage);
+
+// Forwarding-free byref access.
+// __block 变量提升到堆上以后，每次访问仍然要经过 forwarding（byref->forwarding->变量），多一次相互依赖的 load。
+// 返回 byref 提升到堆上（或 GC 下）的那一份，还在栈上时返回 NULL。提升以后 forwarding 不会再变，
+// 只要还持有这个 byref（比如持有引入了它的 block），返回值就一直有效，可以缓存下来直接访问。
+// byref 是栈上或者堆上的 Block_byref 都可以。C++ 中见 BlockByref.h
+BLOCK_EXPORT void *_Block_byref_resolve(const void *byref);
+
+// Allocation statistics for the heaps used by non-GC copies.
+// 非 GC 下，堆上的 block 和 byref 分别从两个独立的 slab heap 中分配，下面是它们的统计数据。
+// 数据是从各个线程的缓存中汇总出来的，不保证精确，只用于诊断。
+enum {
+    BLOCK_HEAP_BLOCKS = 0,  // 堆上的 block
+    BLOCK_HEAP_BYREFS = 1,  // 堆上的 __block 变量
+};
+
+struct Block_heap_statistics {
+    size_t   size;              // size == sizeof(struct Block_heap_statistics)
+    uint64_t allocations;       // 从 size class 中分配的次数
+    uint64_t frees;             // 还给 size class 的次数
+    uint64_t remoteFrees;       // 其中在别的线程上释放的次数
+    uint64_t largeAllocations;  // 太大，直接 malloc 的次数
+    uint64_t chunks;            // 向系统要的 chunk 个数
+};
+typedef struct Block_heap_statistics Block_heap_statistics;
+
+BLOCK_EXPORT void _Block_get_heap_statistics(int heap, Block_heap_statistics *stats);
+
+// Huge-page backed heaps.
+// 让 block 和 byref 的 heap 从 2MB 的大页 region 中分配，减少 TLB miss。
+// 只影响之后新开的 chunk，最好在第一次拷贝 block 之前调用。装了自定义分配器时不起作用。
+enum {
+    BLOCK_HUGE_PAGES_NONE = 0,          // 默认，chunk 直接向 malloc 要
+    BLOCK_HUGE_PAGES_TRANSPARENT = 1,   // 2MB 对齐的匿名映射，并建议内核使用透明大页
+    BLOCK_HUGE_PAGES_EXPLICIT = 2,      // 显式的大页（MAP_HUGETLB / superpage），失败时退回透明大页
+};
+
+BLOCK_EXPORT void _Block_use_huge_pages(int mode);
+
+// Batched copies.
+// _Block_copy_n 等于调用 n 次 Block_copy，但是只拷贝一次，引用计数一次加 n，返回的 block 要 release n 次。
+// _Block_copy_many 等于对每个 block 调用 Block_copy，栈上的 block 一起放在同一块内存中，
+// 这块内存在其中的 block 全部释放以后才回收。
+BLOCK_EXPORT void *_Block_copy_n(const void *aBlock, size_t n);
+BLOCK_EXPORT void _Block_copy_many(const void **blocks, void **copies, size_t n);
+
+// Batched release.
+// 和对每个 block 调用 Block_release 一样，但是引用计数减到 0 的 block 按 descriptor 分组销毁，内存一起还给 heap
+BLOCK_EXPORT void _Block_release_many(const void **blocks, size_t n);
+
+// Biased reference counting.
+// 打开后，从拷贝它的线程的 magazine 中分配的 block，在这个线程上 retain/release 不做原子操作。
+// 默认关闭：打开后别的线程上的最后一次 release 要等拷贝它的线程下次 retain/release 时才销毁 block
+// （dispose helper 也在那个线程上调用），那个线程空闲时被引入的对象会一直不释放。
+// 只影响之后拷贝的 block
+BLOCK_EXPORT void _Block_use_biased_refcounts(bool enable);
+
+// NUMA placement.
+// 和 Block_copy 一样，但是拷贝到堆上的 block、byref 和被引入的 block 都放在 NUMA node 上。
+// 通常传入之后运行这个 block 的线程的 _Block_current_numa_node()。node 超出范围时等同于 Block_copy
+BLOCK_EXPORT void *_Block_copy_to_node(const void *aBlock, int node);
+
+// 当前线程所在的 NUMA node，不支持 NUMA 的系统上总是 0
+BLOCK_EXPORT int _Block_current_numa_node(void);
+
 
 // Obsolete  废弃的
 
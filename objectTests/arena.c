@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 拷贝到 arena 中的 block 不做引用计数，arena 销毁时统一 dispose。
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+typedef int (^IntBlock)(void);
+
+int main() {
+    __block int counter = 0;
+    IntBlock inner = ^{ return 7; };
+    IntBlock heapInner = Block_copy(^{ return counter; });
+    char buffer[1024] __attribute__((aligned(16)));
+
+    for (int pass = 0; pass < 2; ++pass) {
+        Block_arena_t arena = pass ? _Block_arena_create(buffer, sizeof(buffer))
+                                   : _Block_arena_create(NULL, 0);
+        if (!arena) {
+            fail("could not create arena");
+        }
+
+        IntBlock handlers[200];
+        for (int i = 0; i < 200; ++i) {
+            // captures a stack block, a heap block and a __block variable
+            handlers[i] = _Block_copy_in_arena(^{ return ++counter + inner() + heapInner() - counter; }, arena);
+            if (Block_copy(handlers[i]) != handlers[i]) {
+                fail("copying an arena block made a new copy");
+            }
+            Block_release(handlers[i]);
+        }
+        for (int i = 0; i < 200; ++i) {
+            if (handlers[i]() != 7 + counter) {
+                fail("arena block %d has bad captures", i);
+            }
+        }
+        if (_Block_copy_in_arena(heapInner, arena) != heapInner) {
+            fail("heap block should be retained, not copied, by the arena");
+        }
+
+        _Block_arena_destroy(arena);
+    }
+
+    if (heapInner() != counter) {
+        fail("arena teardown over-released a heap block");
+    }
+    Block_release(heapInner);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 默认不打开 biased refcount：在主线程拷贝、在别的线程最后一次 release 的 block 立即被释放。
+// 打开以后，拷贝 block 的线程上的 retain/release 只改 local count。
+// block 交给别的线程 release、拷贝它的线程先退出时，最后都要被释放。
+// VERBOSE=1 时打印打开和关掉 biased refcount 时单线程 retain/release 的耗时。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 10000
+#define ITERATIONS 10000000
+
+typedef long (^LongBlock)(void);
+
+static LongBlock queue[COUNT];
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t blockFrees(void) {
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    return stats.frees;
+}
+
+static uint64_t churn(void) {
+    long a = 1;
+    LongBlock block = Block_copy(^{ return a; });
+    uint64_t start = now();
+    for (int i = 0; i < ITERATIONS; ++i) {
+        Block_copy(block);
+        Block_release(block);
+    }
+    uint64_t elapsed = now() - start;
+    Block_release(block);
+    return elapsed;
+}
+
+// 拷贝以后多 retain 一次，然后退出，两个引用都由别的线程 release
+static void *producer(void *arg __unused) {
+    for (long i = 0; i < COUNT; ++i) {
+        long a = i;
+        queue[i] = Block_copy(^{ return a; });
+        Block_copy(queue[i]);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg __unused) {
+    for (long i = 0; i < COUNT; ++i) {
+        if (queue[i]() != i) {
+            fail("block %ld has bad captures", i);
+        }
+        Block_release(queue[i]);
+    }
+    return NULL;
+}
+
+// 在别的线程上 release 主线程拷贝的 block
+static void *releaser(void *arg __unused) {
+    for (long i = 0; i < COUNT; ++i) {
+        Block_release(queue[i]);
+    }
+    return NULL;
+}
+
+int main() {
+    uint64_t frees = blockFrees();
+    for (long i = 0; i < COUNT; ++i) {
+        long a = i;
+        queue[i] = Block_copy(^{ return a; });
+    }
+    pthread_t r;
+    pthread_create(&r, NULL, releaser, NULL);
+    pthread_join(r, NULL);
+    if (blockFrees() != frees + COUNT) {
+        fail("blocks released on another thread were not freed immediately");
+    }
+
+    _Block_use_biased_refcounts(true);
+    uint64_t biased = churn();
+    _Block_use_biased_refcounts(false);
+    uint64_t shared = churn();
+    _Block_use_biased_refcounts(true);
+    testprintf("%d retain/release pairs: biased %llu us, atomic %llu us\n",
+               ITERATIONS, (unsigned long long)biased, (unsigned long long)shared);
+
+    frees = blockFrees();
+    pthread_t p, c;
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_join(p, NULL);
+    pthread_create(&c, NULL, consumer, NULL);
+    pthread_join(c, NULL);
+    for (long i = 0; i < COUNT; ++i) {
+        Block_release(queue[i]);
+    }
+    if (blockFrees() != frees + COUNT) {
+        fail("blocks released after their owner exited were not freed");
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_CFLAGS -std=c++11
+
+// BlockRef<R(Args...)>：拷贝只给堆上的 block 加一次引用计数，移动不改变引用计数，
+// 最后一个引用释放时 block 中引入的 C++ 对象被析构。operator() 直接调用 invoke。
+
+#include <stdio.h>
+#include <utility>
+#include <Block.h>
+#include <Block_private.h>
+#include <BlockRef.h>
+#include "test.h"
+
+using libclosure::BlockRef;
+
+int constructors = 0;
+int destructors = 0;
+
+class TestObject
+{
+public:
+    TestObject() : _version(++constructors) { }
+    TestObject(const TestObject &inObj) : _version(inObj._version) { ++constructors; }
+    ~TestObject() { ++destructors; }
+
+    int version() const { return _version; }
+private:
+    int _version;
+};
+
+static int refcount(const BlockRef<int(int)> &ref) {
+    return (((struct Block_layout *)ref.get())->flags & BLOCK_REFCOUNT_MASK) / 2;
+}
+
+// 按值接收，调用者用 std::move 传进来时不会加引用计数
+static int callByValue(BlockRef<int(int)> ref, int arg) {
+    return ref(arg);
+}
+
+static BlockRef<int(int)> makeAdder() {
+    TestObject one;
+    return ^(int arg) { return arg + one.version(); };
+}
+
+int main() {
+    // biased 的引用计数不记在 flags 中
+    _Block_use_biased_refcounts(false);
+
+    {
+        BlockRef<int(int)> adder = makeAdder();
+        if (!adder || adder(10) != 11 || refcount(adder) != 1) {
+            fail("block was not copied to the heap");
+        }
+
+        BlockRef<int(int)> copy = adder;
+        if (copy != adder || refcount(adder) != 2) {
+            fail("copy did not add exactly one reference");
+        }
+
+        BlockRef<int(int)> moved = std::move(copy);
+        if (copy || moved != adder || refcount(adder) != 2) {
+            fail("move changed the refcount");
+        }
+
+        if (callByValue(std::move(moved), 20) != 21 || moved || refcount(adder) != 1) {
+            fail("passing by value with std::move changed the refcount");
+        }
+        if (callByValue(adder, 30) != 31 || refcount(adder) != 1) {
+            fail("passing by value did not balance the refcount");
+        }
+
+        BlockRef<int(int)> assigned;
+        assigned = adder;
+        assigned = adder;
+        if (refcount(adder) != 2) {
+            fail("copy assignment did not add exactly one reference");
+        }
+        assigned = nullptr;
+        if (refcount(adder) != 1) {
+            fail("assigning nullptr did not release");
+        }
+
+        void *raw = adder.release();
+        BlockRef<int(int)> adopted = BlockRef<int(int)>::adopt(raw);
+        if (adopted(1) != 2 || refcount(adopted) != 1) {
+            fail("adopt changed the refcount");
+        }
+    }
+    if (constructors != destructors) {
+        fail("%d constructors, %d destructors", constructors, destructors);
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_CFLAGS -std=c++11
+
+// 小的栈上的 block 放进 Block_storage_t / BlockStorage 时拷贝到 buffer 中，不经过分配器；
+// 放不下的 block、share() 和对 buffer 中的 block 调用 Block_copy 时才分配。
+// 销毁时 buffer 中的 block 调用 dispose helper，被引入的堆上的 block 引用计数恢复原样。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Block.h>
+#include <Block_private.h>
+#include <BlockStorage.h>
+#include "test.h"
+
+using libclosure::BlockRef;
+using libclosure::BlockStorage;
+
+static int allocations;
+
+static void *countingAlloc(size_t size, int kind __unused, void *context __unused) {
+    ++allocations;
+    return malloc(size);
+}
+
+static void countingFree(void *ptr, int kind __unused, void *context __unused) {
+    free(ptr);
+}
+
+static int refcount(const void *block) {
+    return (((struct Block_layout *)block)->flags & BLOCK_REFCOUNT_MASK) / 2;
+}
+
+// 连接对象中的 completion handler
+struct connection {
+    int status;
+    Block_storage_t completion;
+};
+
+int main() {
+    Block_callbacks_allocator allocator = { sizeof(allocator), NULL, countingAlloc, countingFree, NULL };
+    _Block_use_allocator(&allocator);
+    _Block_use_biased_refcounts(false);
+
+    int base = 10;
+    int (^shared)(int) = Block_copy(^(int arg) { return arg + base; });
+    int before = allocations;
+
+    struct connection connection;
+    connection.status = 5;
+    int status = connection.status;
+    _Block_storage_init(&connection.completion, (const void *)^(int arg) { return shared(arg) + status; });
+    if (connection.completion.block != (void *)connection.completion.buffer || allocations != before) {
+        fail("small block was not stored inline");
+    }
+    if (refcount(shared) != 2) {
+        fail("copy helper did not retain the captured block");
+    }
+    int (^completion)(int) = (int (^)(int))connection.completion.block;
+    if (completion(1) != 16) {
+        fail("inline block returned %d", completion(1));
+    }
+
+    // Block_copy 得到的是堆上的拷贝
+    int (^heap)(int) = Block_copy(completion);
+    if ((void *)heap == connection.completion.block || allocations != before + 1 || heap(2) != 17) {
+        fail("Block_copy of an inline block did not copy it to the heap");
+    }
+    Block_release(heap);
+
+    _Block_storage_destroy(&connection.completion);
+    if (refcount(shared) != 1 || connection.completion.block != NULL) {
+        fail("dispose helper did not run");
+    }
+
+    // 放不下的 block 在堆上
+    double a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7;
+    before = allocations;
+    _Block_storage_init(&connection.completion, (const void *)^(int arg) { return (int)(arg + a + b + c + d + e + f + g); });
+    if (connection.completion.block == (void *)connection.completion.buffer || allocations != before + 1) {
+        fail("large block was stored inline");
+    }
+    _Block_storage_destroy(&connection.completion);
+
+    // C++
+    {
+        before = allocations;
+        BlockStorage<int(int)> storage = ^(int arg) { return shared(arg) * 2; };
+        BlockStorage<int(int)> copy = storage;
+        BlockStorage<int(int)> moved = std::move(copy);
+        if (!storage.isInline() || !moved.isInline() || copy || allocations != before) {
+            fail("copying or moving an inline BlockStorage allocated");
+        }
+        if (storage(1) != 22 || moved(2) != 24 || refcount(shared) != 3) {
+            fail("inline BlockStorage copies are wrong");
+        }
+
+        BlockRef<int(int)> ref = moved.share();
+        if (moved.isInline() || allocations != before + 1 || ref(3) != 26 || moved(4) != 28) {
+            fail("share() did not promote the block to the heap");
+        }
+        if (refcount(ref.get()) != 2 || refcount(shared) != 3) {
+            fail("share() did not balance the refcounts");
+        }
+    }
+    if (refcount(shared) != 1) {
+        fail("BlockStorage did not release the captured block");
+    }
+
+    Block_release(shared);
+    succeed(__FILE__);
+}
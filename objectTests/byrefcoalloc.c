@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 打开 co-allocation 后，block 第一次拷贝时和它的 __block 变量共用一块内存。
+// byref 可能比 block 活得更久，两种释放顺序都要正确。
+// 纯 C 的 clang 不生成扩展布局，这里像 layoutcopy.c 一样手工构造带扩展布局的 block（两个 __block 变量）。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+struct byref_int {
+    void *isa;
+    struct byref_int *forwarding;
+    volatile int32_t flags;
+    uint32_t size;
+    int value;
+};
+
+struct pair_block {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void (*invoke)(void *, ...);
+    struct pair_descriptor *descriptor;
+    struct byref_int *i;
+    struct byref_int *j;
+};
+
+struct pair_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+    const char *signature;
+    const char *layout;
+};
+
+static void pair_copy(void *dst, const void *src) {
+    struct pair_block *d = (struct pair_block *)dst;
+    const struct pair_block *s = (const struct pair_block *)src;
+    _Block_object_assign(&d->i, s->i, BLOCK_FIELD_IS_BYREF);
+    _Block_object_assign(&d->j, s->j, BLOCK_FIELD_IS_BYREF);
+}
+
+static void pair_dispose(const void *src) {
+    const struct pair_block *s = (const struct pair_block *)src;
+    _Block_object_dispose(s->i, BLOCK_FIELD_IS_BYREF);
+    _Block_object_dispose(s->j, BLOCK_FIELD_IS_BYREF);
+}
+
+// 2 个 byref
+static struct pair_descriptor descriptor = {
+    0, sizeof(struct pair_block), pair_copy, pair_dispose, "i8@?0", "\x41"
+};
+
+// 第二个 block 共享同一个 byref，只用到 i
+static struct byref_int *survivor;
+static struct pair_block *survivorBlock;
+
+static int sum(struct pair_block *block) {
+    return ++block->i->forwarding->value + block->j->forwarding->value;
+}
+
+static void makeBlocks(int releaseFirst) {
+    struct byref_int i = { NULL, &i, 0, sizeof(i), 10 };
+    struct byref_int j = { NULL, &j, 0, sizeof(j), 20 };
+    struct pair_block stack = {
+        _NSConcreteStackBlock,
+        BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_SIGNATURE | BLOCK_HAS_EXTENDED_LAYOUT,
+        0, NULL, &descriptor, &i, &j
+    };
+
+    struct pair_block *block = (struct pair_block *)_Block_copy(&stack);
+    if (!(block->flags & BLOCK_COALLOCATED)) {
+        fail("block with __block variables was not co-allocated");
+    }
+    // 两个 byref 紧跟在 block 后面
+    char *start = (char *)block, *end = start + 256;
+    if ((char *)i.forwarding < start || (char *)i.forwarding > end
+        || (char *)j.forwarding < start || (char *)j.forwarding > end
+        || !(i.forwarding->flags & BLOCK_BYREF_COALLOCATED) || !(j.forwarding->flags & BLOCK_BYREF_COALLOCATED)) {
+        fail("byrefs were not placed with the block");
+    }
+
+    survivorBlock = (struct pair_block *)_Block_copy(&stack);
+    survivor = i.forwarding;
+    if (survivorBlock == block || survivorBlock->i != block->i) {
+        fail("co-allocated byrefs are not shared");
+    }
+    if (sum(block) != 31 || survivor->value != 11) {
+        fail("co-allocated byrefs are not shared");
+    }
+
+    if (releaseFirst) {
+        _Block_release(block);
+    } else {
+        _Block_release(survivorBlock);
+        survivorBlock = NULL;
+        _Block_release(block);
+    }
+    // 栈帧结束时编译器对 __block 变量做的事
+    _Block_object_dispose(&i, BLOCK_FIELD_IS_BYREF);
+    _Block_object_dispose(&j, BLOCK_FIELD_IS_BYREF);
+}
+
+int main() {
+    _Block_use_byref_coallocation(true);
+
+    for (int round = 0; round < 100; ++round) {
+        makeBlocks(round & 1);
+        if (survivorBlock) {
+            // byref 还活着，它所在的那块内存不能被释放
+            if (survivorBlock->i->value != 11) {
+                fail("byref did not outlive its block");
+            }
+            _Block_release(survivorBlock);
+            survivorBlock = NULL;
+        }
+    }
+
+    _Block_use_byref_coallocation(false);
+    succeed(__FILE__);
+}
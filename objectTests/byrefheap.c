@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// __block 变量和 block 分别从各自的 heap 中分配，统计数据也是分开的。
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static void getStatistics(Block_heap_statistics *blocks, Block_heap_statistics *byrefs) {
+    blocks->size = sizeof(*blocks);
+    byrefs->size = sizeof(*byrefs);
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, blocks);
+    _Block_get_heap_statistics(BLOCK_HEAP_BYREFS, byrefs);
+}
+
+int main() {
+    Block_heap_statistics blocks0, byrefs0, blocks1, byrefs1, blocks2, byrefs2;
+    getStatistics(&blocks0, &byrefs0);
+
+    {
+        __block int i = 10;
+        __block int j = 20;
+        void (^block)(void) = Block_copy(^{ ++i; ++j; });
+        void (^block2)(void) = Block_copy(^{ ++i; });
+        block();
+        block2();
+        if (i != 12 || j != 21) {
+            fail("heap byrefs were not shared with the stack");
+        }
+
+        getStatistics(&blocks1, &byrefs1);
+        Block_release(block);
+        Block_release(block2);
+    }
+    getStatistics(&blocks2, &byrefs2);
+
+    // 一个 byref 已经在堆上了，第二个 block 只增加引用计数
+    if (blocks1.allocations - blocks0.allocations != 2) {
+        fail("expected 2 block allocations, got %llu",
+             (unsigned long long)(blocks1.allocations - blocks0.allocations));
+    }
+    if (byrefs1.allocations - byrefs0.allocations != 2) {
+        fail("expected 2 byref allocations, got %llu",
+             (unsigned long long)(byrefs1.allocations - byrefs0.allocations));
+    }
+    if (blocks2.frees - blocks1.frees != 2) {
+        fail("blocks were not returned to the block heap");
+    }
+    if (byrefs2.frees - byrefs1.frees != 2) {
+        fail("byrefs were not returned to the byref heap");
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_CFLAGS -std=c++11
+
+// Examples/BasicByRef 中的 localCount，按 TestBlock 中改写出来的样子手写 byref 和 block。
+// 提升到堆上之前 _Block_byref_resolve() 返回 NULL，ByrefAccessor 经过 forwarding 访问栈上的变量；
+// 提升以后缓存堆上的地址，写入对 block 可见。VERBOSE=1 时打印经过 forwarding 和直接访问的耗时。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <Block.h>
+#include <Block_private.h>
+#include <BlockByref.h>
+#include "test.h"
+
+#define COUNT 100000000
+
+using libclosure::ByrefAccessor;
+
+struct __Block_byref_localCount_0 {
+    void *__isa;
+    __Block_byref_localCount_0 *__forwarding;
+    int __flags;
+    int __size;
+    int localCount;
+};
+
+struct __main_block_impl_0 {
+    void *isa;
+    int Flags;
+    int Reserved;
+    void (*FuncPtr)(__main_block_impl_0 *);
+    struct __main_block_desc_0 *Desc;
+    __Block_byref_localCount_0 *localCount; // by ref
+};
+
+static void __main_block_func_0(__main_block_impl_0 *__cself) {
+    __Block_byref_localCount_0 *localCount = __cself->localCount; // bound by ref
+    (localCount->__forwarding->localCount)++;
+}
+
+static void __main_block_copy_0(void *dst, const void *src) {
+    _Block_object_assign(&((__main_block_impl_0 *)dst)->localCount, ((const __main_block_impl_0 *)src)->localCount, BLOCK_FIELD_IS_BYREF);
+}
+
+static void __main_block_dispose_0(const void *src) {
+    _Block_object_dispose(((const __main_block_impl_0 *)src)->localCount, BLOCK_FIELD_IS_BYREF);
+}
+
+static struct __main_block_desc_0 {
+    size_t reserved;
+    size_t Block_size;
+    void (*copy)(void *, const void *);
+    void (*dispose)(const void *);
+} __main_block_desc_0_DATA = { 0, sizeof(__main_block_impl_0), __main_block_copy_0, __main_block_dispose_0 };
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// 循环体中有看不见的代码（比如函数调用）时，编译器每次都要重新读 forwarding
+#define OPAQUE() __asm__ __volatile__("" ::: "memory")
+
+int main() {
+    __Block_byref_localCount_0 localCount = { 0, &localCount, 0, sizeof(localCount), 0 };
+    __main_block_impl_0 stack = {
+        _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, __main_block_func_0, &__main_block_desc_0_DATA, &localCount
+    };
+
+    ByrefAccessor<int> count(&localCount, &localCount.localCount);
+    if (_Block_byref_resolve(&localCount) != NULL || count.resolve() != nullptr) {
+        fail("stack byref was resolved");
+    }
+    ++*count;
+    if (localCount.localCount != 1 || count.isResolved()) {
+        fail("access before promotion did not go to the stack");
+    }
+
+    __main_block_impl_0 *incrementLocal = (__main_block_impl_0 *)Block_copy(&stack);
+    __Block_byref_localCount_0 *heap = localCount.__forwarding;
+    if (heap == &localCount || _Block_byref_resolve(&localCount) != heap || _Block_byref_resolve(heap) != heap) {
+        fail("promoted byref was not resolved to the heap");
+    }
+    int *resolved = count.resolve();
+    if (resolved != &heap->localCount || *resolved != 1) {
+        fail("accessor did not cache the heap variable");
+    }
+
+    incrementLocal->FuncPtr(incrementLocal);
+    ++*count;
+    if (*resolved != 3 || heap->localCount != 3) {
+        fail("heap variable is %d", heap->localCount);
+    }
+
+    uint64_t start = now();
+    for (int i = 0; i < COUNT; i++) {
+        OPAQUE();
+        localCount.__forwarding->localCount++;
+    }
+    uint64_t forwarded = now() - start;
+
+    start = now();
+    int *direct = count.resolve();
+    for (int i = 0; i < COUNT; i++) {
+        OPAQUE();
+        ++*direct;
+    }
+    uint64_t cached = now() - start;
+    testprintf("forwarding %llu us, resolved %llu us\n", (unsigned long long)forwarded, (unsigned long long)cached);
+
+    if (heap->localCount != 3 + 2 * COUNT) {
+        fail("heap variable is %d", heap->localCount);
+    }
+
+    Block_release(incrementLocal);
+    _Block_object_dispose(&localCount, BLOCK_FIELD_IS_BYREF);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// copy helper 中被引入对象的拷贝构造函数抛出异常时，runtime 在当前线程上登记的 worklist 要随着栈展开恢复。
+// 之后直接调用 _Block_object_assign() 拷贝 block（没有外面的 Block_copy）时，copy helper 仍然要立即调用，
+// 不能放进已经销毁的栈帧中的 worklist。
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+int copies = 0;
+bool shouldThrow = false;
+
+class TestObject
+{
+public:
+    TestObject() : _version(1) { }
+    TestObject(const TestObject &inObj) : _version(inObj._version) {
+        if (shouldThrow) throw inObj._version;
+        ++copies;
+    }
+    ~TestObject() { }
+
+    int version() const { return _version; }
+private:
+    int _version;
+};
+
+int main() {
+    TestObject object;
+    int (^block)(void) = ^{ return object.version(); };
+
+    shouldThrow = true;
+    try {
+        Block_copy(block);  // 抛出异常，拷贝了一半的 block 泄漏
+        fail("copy constructor did not throw");
+    } catch (int version) {
+        testprintf("caught %d\n", version);
+    }
+    shouldThrow = false;
+    copies = 0;
+
+    void *copy = NULL;
+    _Block_object_assign(&copy, (const void *)block, BLOCK_FIELD_IS_BLOCK);
+    if (copies != 1) {
+        fail("copy helper was not called after an exception unwound a copy (%d copies)", copies);
+    }
+    if (((int (^)(void))copy)() != 1) {
+        fail("copied block is broken");
+    }
+    _Block_object_dispose(copy, BLOCK_FIELD_IS_BLOCK);
+
+    succeed(__FILE__);
+}
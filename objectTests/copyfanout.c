@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// _Block_copy_n() 拷贝一次，得到 n 个引用；_Block_copy_many() 一次拷贝一组栈上的 block。
+// 结果要和逐个 Block_copy 一样：被引入的变量正确，__block 变量共享，全部 release 以后被释放。
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define CONSUMERS 16
+
+typedef long (^LongBlock)(void);
+
+static uint64_t blockFrees(void) {
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    return stats.frees;
+}
+
+int main() {
+    long a = 7;
+    LongBlock queues[CONSUMERS];
+
+    // one stack block fanned out to many consumers
+    LongBlock shared = _Block_copy_n(^{ return a; }, CONSUMERS);
+    for (int i = 0; i < CONSUMERS; ++i) {
+        queues[i] = shared;
+    }
+    if (_Block_copy_n(shared, 0) != NULL) {
+        fail("_Block_copy_n with n == 0 should return NULL");
+    }
+    uint64_t frees = blockFrees();
+    for (int i = 0; i < CONSUMERS; ++i) {
+        if (queues[i]() != 7) {
+            fail("fanned-out block has bad captures");
+        }
+        Block_release(queues[i]);
+        if (i < CONSUMERS - 1 && blockFrees() != frees) {
+            fail("block freed after %d of %d releases", i + 1, CONSUMERS);
+        }
+    }
+    if (blockFrees() != frees + 1) {
+        fail("fanned-out block was not freed");
+    }
+
+    // several stack blocks promoted together
+    __block long counter = 0;
+    long b = 1, c = 2;
+    const void *stack[4] = {
+        ^{ return ++counter; },
+        ^{ return counter + b; },
+        NULL,
+        ^{ return c; },
+    };
+    void *copies[4];
+    _Block_copy_many(stack, copies, 4);
+    if (copies[2] != NULL) {
+        fail("NULL entry was not copied as NULL");
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (copies[i] && copies[i] == stack[i]) {
+            fail("block %d was not copied to the heap", i);
+        }
+    }
+    if (((LongBlock)copies[0])() != 1 || ((LongBlock)copies[1])() != 2 || ((LongBlock)copies[3])() != 2) {
+        fail("batch-copied blocks have bad captures");
+    }
+    if (counter != 1) {
+        fail("batch-copied blocks do not share the __block variable");
+    }
+    for (int i = 0; i < 4; ++i) {
+        Block_release(copies[i]);
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 同一个 block 字面量反复拷贝、释放，第一次之后用的是缓存的 copy plan。
+// 检查拷贝的结果，以及同一个 descriptor 在 flags 不同时不会用错 plan。VERBOSE=1 时打印耗时。
+// Linux 上只缓存主程序中的 descriptor：不在主程序中的 descriptor 换了 helper（好比 dlclose 以后地址被别的 image 用上），
+// 要调用新的 helper。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 1000000
+
+typedef int (^IntBlock)(void);
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+struct signature_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    const char *signature;
+    const char *layout;
+};
+
+static struct signature_descriptor descriptor = {
+    0, sizeof(struct Block_layout), "v8@?0", NULL
+};
+
+struct helper_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+};
+
+static int oldHelperCalls, newHelperCalls;
+
+static void old_copy(void *dst __unused, const void *src __unused) { ++oldHelperCalls; }
+static void old_dispose(const void *src __unused) { ++oldHelperCalls; }
+static void new_copy(void *dst __unused, const void *src __unused) { ++newHelperCalls; }
+static void new_dispose(const void *src __unused) { ++newHelperCalls; }
+
+static void copyWith(struct helper_descriptor *helpers) {
+    struct Block_layout stack = { _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, NULL, (struct Block_descriptor_1 *)helpers };
+    Block_release(Block_copy((void *)&stack));
+}
+
+int main() {
+    __block int counter = 0;
+    int step = 1;
+    IntBlock inner = ^{ return step; };
+
+    uint64_t start = now();
+    for (int i = 0; i < COUNT; i++) {
+        IntBlock block = Block_copy(^{ counter += inner(); return counter; });
+        if (block() != i + 1) {
+            fail("copy %d has bad captures", i);
+        }
+        Block_release(block);
+    }
+    testprintf("%d copy/release pairs: %llu us\n", COUNT, (unsigned long long)(now() - start));
+
+    IntBlock block = ^{ return counter; };
+    const char *signature = _Block_signature(block);
+    IntBlock copy = Block_copy(block);
+    if (_Block_signature(copy) != signature) {
+        fail("signature changed after copy");
+    }
+    Block_release(copy);
+
+    // 同一个 descriptor，有没有 BLOCK_HAS_SIGNATURE 决定了签名在不在
+    struct Block_layout literal = { _NSConcreteGlobalBlock, BLOCK_IS_GLOBAL | BLOCK_HAS_SIGNATURE, 0, NULL, (struct Block_descriptor_1 *)&descriptor };
+    if (!_Block_signature(&literal) || strcmp(_Block_signature(&literal), "v8@?0") != 0) {
+        fail("missing signature");
+    }
+    literal.flags = BLOCK_IS_GLOBAL;
+    if (_Block_signature(&literal) != NULL) {
+        fail("signature without BLOCK_HAS_SIGNATURE");
+    }
+
+#if __linux__
+    struct helper_descriptor *helpers = (struct helper_descriptor *)malloc(sizeof(struct helper_descriptor));
+    *helpers = (struct helper_descriptor){ 0, sizeof(struct Block_layout), old_copy, old_dispose };
+    copyWith(helpers);
+    helpers->copy = new_copy;
+    helpers->dispose = new_dispose;
+    copyWith(helpers);
+    if (oldHelperCalls != 2 || newHelperCalls != 2) {
+        fail("stale helpers called: old %d, new %d", oldHelperCalls, newHelperCalls);
+    }
+    free(helpers);
+#endif
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 拷贝不同大小的 block，检查被引入的变量拷贝正确，VERBOSE=1 时打印每种大小一次拷贝加释放的耗时。
+// 常见的大小走按大小特化的拷贝，其他大小（比如 136）走 memcpy，可以拿来对比。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 1000000
+#define MAX_WORDS 16
+
+struct sized_block {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void (*invoke)(void *, ...);
+    struct Block_descriptor_1 *descriptor;
+    uintptr_t words[MAX_WORDS];
+};
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+int main() {
+    static const unsigned counts[] = { 0, 1, 2, 3, 4, 6, 8, 10, 12, 13 };
+    struct Block_descriptor_1 descriptors[sizeof(counts) / sizeof(counts[0])];
+
+    for (unsigned i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+        unsigned n = counts[i];
+        descriptors[i].reserved = 0;
+        descriptors[i].size = sizeof(struct Block_layout) + n * sizeof(uintptr_t);
+
+        struct sized_block stack = { _NSConcreteStackBlock, 0, 0, NULL, &descriptors[i], { 0 } };
+        for (unsigned w = 0; w < n; w++) {
+            stack.words[w] = 0x1000 * i + w;
+        }
+
+        struct sized_block *copy = (struct sized_block *)_Block_copy(&stack);
+        for (unsigned w = 0; w < n; w++) {
+            if (copy->words[w] != stack.words[w]) {
+                fail("size %lu: word %u not copied", (unsigned long)descriptors[i].size, w);
+            }
+        }
+        if (copy->invoke != stack.invoke || copy->descriptor != stack.descriptor) {
+            fail("size %lu: header not copied", (unsigned long)descriptors[i].size);
+        }
+        _Block_release(copy);
+
+        uint64_t start = now();
+        for (int k = 0; k < COUNT; k++) {
+            _Block_release(_Block_copy(&stack));
+        }
+        testprintf("size %3lu: %llu ns per copy/release\n", (unsigned long)descriptors[i].size,
+                   (unsigned long long)((now() - start) * 1000 / COUNT));
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 装上自定义的分配器后，堆上的 block 和 __block 变量都从它分配，并且交还给它释放。
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static int allocations[2];
+static int frees[2];
+static int context;
+
+static void *testAlloc(size_t size, int kind, void *ctx) {
+    if (ctx != &context) fail("wrong context");
+    allocations[kind]++;
+    return malloc(size);
+}
+
+static void testFree(void *ptr, int kind, void *ctx) {
+    if (ctx != &context) fail("wrong context");
+    frees[kind]++;
+    free(ptr);
+}
+
+int main() {
+    Block_callbacks_allocator callbacks = {
+        sizeof(Block_callbacks_allocator), &context, testAlloc, testFree, NULL
+    };
+    _Block_use_allocator(&callbacks);
+
+    {
+        __block int i = 0;
+        int j = 5;
+        void (^block)(void) = Block_copy(^{ i += j; });
+        block();
+        Block_release(block);
+        if (i != 5) {
+            fail("block did not update its __block variable");
+        }
+    }
+
+    if (allocations[BLOCK_HEAP_BLOCKS] != 1 || allocations[BLOCK_HEAP_BYREFS] != 1) {
+        fail("expected 1 block and 1 byref allocation, got %d and %d",
+             allocations[BLOCK_HEAP_BLOCKS], allocations[BLOCK_HEAP_BYREFS]);
+    }
+    if (frees[BLOCK_HEAP_BLOCKS] != 1 || frees[BLOCK_HEAP_BYREFS] != 1) {
+        fail("expected 1 block and 1 byref free, got %d and %d",
+             frees[BLOCK_HEAP_BLOCKS], frees[BLOCK_HEAP_BYREFS]);
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 打开大页模式后，block 和 byref 的 chunk 从 2MB 的 region 中分配。
+// 系统不支持显式大页时要能退回透明大页。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 20000
+
+typedef long (^LongBlock)(void);
+
+static LongBlock blocks[COUNT];
+
+static void churn(void) {
+    for (long i = 0; i < COUNT; ++i) {
+        __block long counter = i;
+        long a = i;
+        blocks[i] = Block_copy(^{ return ++counter + a; });
+    }
+    for (long i = 0; i < COUNT; ++i) {
+        if (blocks[i]() != 2 * i + 1) {
+            fail("block %ld has bad captures", i);
+        }
+        Block_release(blocks[i]);
+    }
+}
+
+int main() {
+    _Block_use_huge_pages(BLOCK_HUGE_PAGES_TRANSPARENT);
+    churn();
+
+    _Block_use_huge_pages(BLOCK_HUGE_PAGES_EXPLICIT);
+    churn();
+
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    if (stats.chunks == 0) {
+        fail("no chunks were allocated for the block heap");
+    }
+
+    succeed(__FILE__);
+}
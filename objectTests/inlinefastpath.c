@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 打开 BLOCK_INLINE_FAST_PATH 以后，Block_copy / Block_release 在调用处处理堆上和全局区的 block，
+// 其他情况交给 runtime。检查引用计数和 out-of-line 的版本一致，VERBOSE=1 时打印两者的耗时。
+
+#define BLOCK_INLINE_FAST_PATH 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 10000000
+
+typedef int (^IntBlock)(void);
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int refcount(IntBlock block) {
+    return (((struct Block_layout *)block)->flags & BLOCK_REFCOUNT_MASK) / 2;
+}
+
+int main() {
+    // biased 的 block 总是交给 runtime，这里要测的是 shared count
+    _Block_use_biased_refcounts(false);
+
+    int x = 10;
+    IntBlock heap = Block_copy(^{ return x; });
+    if (heap() != 10 || refcount(heap) != 1) {
+        fail("stack block was not promoted");
+    }
+
+    if (Block_copy(heap) != heap || refcount(heap) != 2) {
+        fail("inline copy did not retain");
+    }
+    Block_release(heap);
+    if (refcount(heap) != 1) {
+        fail("inline release did not release");
+    }
+
+    // 越过 side table 的边界时交给 runtime
+    for (int i = 0; i < 70000; i++) {
+        Block_copy(heap);
+    }
+    if (!(((struct Block_layout *)heap)->flags & BLOCK_REFCOUNT_SPILLED)) {
+        fail("refcount did not spill");
+    }
+    for (int i = 0; i < 70000; i++) {
+        Block_release(heap);
+    }
+    if (refcount(heap) != 1) {
+        fail("refcount did not come back from the side table");
+    }
+
+    uint64_t start = now();
+    for (int i = 0; i < COUNT; i++) {
+        Block_release(Block_copy(heap));
+    }
+    uint64_t inlined = now() - start;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        _Block_release(_Block_copy(heap));
+    }
+    uint64_t outOfLine = now() - start;
+    testprintf("inline %llu us, out-of-line %llu us\n", (unsigned long long)inlined, (unsigned long long)outOfLine);
+
+    Block_release(heap);
+
+    // 全局区和栈上的 block
+    IntBlock global = ^{ return 1; };
+    if (Block_copy(global) != global) {
+        fail("global block was copied");
+    }
+    Block_release(global);
+    Block_release((IntBlock)NULL);
+
+    succeed(__FILE__);
+}
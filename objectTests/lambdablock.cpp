@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+// TEST_CFLAGS -std=c++11 -fno-blocks
+
+// 不用 -fblocks，用 libclosure::makeBlock() 把 lambda 做成栈上的 block：
+// 按 Block_layout 调用 invoke、签名、拷贝到堆上时拷贝构造 lambda、释放时析构它；
+// 平凡的 lambda 没有 copy/dispose helper。
+
+#include <stdio.h>
+#include <string.h>
+#include <Block.h>
+#include <Block_private.h>
+#include <BlockRef.h>
+#include "test.h"
+
+int constructors = 0;
+int destructors = 0;
+
+class TestObject
+{
+public:
+    TestObject(int version) : _version(version) { ++constructors; }
+    TestObject(const TestObject &inObj) : _version(inObj._version) { ++constructors; }
+    ~TestObject() { ++destructors; }
+
+    int version() const { return _version; }
+private:
+    int _version;
+};
+
+// 接收 block 的 C API
+static int callBlock(void *block, int arg) {
+    struct Block_layout *layout = (struct Block_layout *)block;
+    return ((int (*)(void *, int))(void *)layout->invoke)(block, arg);
+}
+
+int main() {
+    {
+        TestObject one(1);
+        auto stack = libclosure::makeBlock<int(int)>([one](int arg) { return arg + one.version(); });
+        struct Block_layout *layout = (struct Block_layout *)stack.get();
+        if (layout->isa != _NSConcreteStackBlock
+            || (layout->flags & (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_CTOR|BLOCK_HAS_SIGNATURE)) != (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_CTOR|BLOCK_HAS_SIGNATURE)) {
+            fail("lambda block has the wrong isa or flags");
+        }
+        if (strcmp(_Block_signature(layout), "i@?i") != 0) {
+            fail("signature is %s", _Block_signature(layout));
+        }
+        if (callBlock(layout, 10) != 11 || stack(20) != 21) {
+            fail("invoke did not call the lambda");
+        }
+
+        int constructed = constructors, destroyed = destructors;
+        void *heap = _Block_copy(layout);
+        if (heap == layout || constructors != constructed + 1 || callBlock(heap, 30) != 31) {
+            fail("copy helper did not copy the lambda");
+        }
+        _Block_release(heap);
+        if (destructors != destroyed + 1) {
+            fail("dispose helper did not destroy the lambda");
+        }
+
+        libclosure::BlockRef<int(int)> ref = stack.copy();
+        if (ref(40) != 41) {
+            fail("BlockRef did not call the copied lambda");
+        }
+
+        int value = 7;
+        auto trivial = libclosure::makeBlock<double(const char *, long)>([&value](const char *, long) { return (double)value; });
+        layout = (struct Block_layout *)trivial.get();
+        if (layout->flags & (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_CTOR)) {
+            fail("trivial lambda has helpers");
+        }
+        const char *expected = sizeof(long) == 8 ? "d@?*q" : "d@?*l";
+        if (strcmp(_Block_signature(layout), expected) != 0) {
+            fail("signature is %s", _Block_signature(layout));
+        }
+        libclosure::BlockRef<double(const char *, long)> trivialRef = trivial.copy();
+        value = 8;
+        if (trivialRef("x", 1) != 8.0) {
+            fail("copied trivial lambda did not see the captured reference");
+        }
+    }
+    if (constructors != destructors) {
+        fail("%d constructors, %d destructors", constructors, destructors);
+    }
+
+    succeed(__FILE__);
+}
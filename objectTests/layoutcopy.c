@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 手工构造一个带 extended layout 的 block（一个强引用的 block、一个 long、一个 __block 变量），
+// 检查 runtime 按 layout 解释拷贝和释放，不再调用 copy/dispose helper；
+// layout 里有 weak 引用时要退回到 helper。
+// 引入的对象不是 block 时，像 ARC 的 helper 那样不经过 callout 直接 retain，
+// 没有装 RR callout 时 runtime 不能代替它；nil 不能解引用；装了 _Block_use_RR2() 以后按 layout 解释。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+struct byref_long {
+    void *isa;
+    struct byref_long *forwarding;
+    volatile int32_t flags;
+    uint32_t size;
+    long value;
+};
+
+struct layout_block {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void (*invoke)(void *, ...);
+    struct layout_descriptor *descriptor;
+    void *inner;
+    long n;
+    struct byref_long *counter;
+};
+
+struct layout_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+    const char *signature;
+    const char *layout;
+};
+
+static int helperCalls;
+
+static void layout_copy(void *dst, const void *src) {
+    struct layout_block *d = (struct layout_block *)dst;
+    const struct layout_block *s = (const struct layout_block *)src;
+    ++helperCalls;
+    _Block_object_assign(&d->inner, s->inner, BLOCK_FIELD_IS_BLOCK);
+    _Block_object_assign(&d->counter, s->counter, BLOCK_FIELD_IS_BYREF);
+}
+
+static void layout_dispose(const void *src) {
+    const struct layout_block *s = (const struct layout_block *)src;
+    ++helperCalls;
+    _Block_object_dispose(s->inner, BLOCK_FIELD_IS_BLOCK);
+    _Block_object_dispose(s->counter, BLOCK_FIELD_IS_BYREF);
+}
+
+// 引入的是对象，像 ARC 的 helper 那样直接 retain（objc_retain），不经过 _Block_object_assign()
+static int retains;
+
+static void object_copy(void *dst, const void *src) {
+    struct layout_block *d = (struct layout_block *)dst;
+    const struct layout_block *s = (const struct layout_block *)src;
+    ++helperCalls;
+    if (s->inner) ++retains;
+    _Block_object_assign(&d->counter, s->counter, BLOCK_FIELD_IS_BYREF);
+}
+
+static void object_dispose(const void *src) {
+    const struct layout_block *s = (const struct layout_block *)src;
+    ++helperCalls;
+    if (s->inner) --retains;
+    _Block_object_dispose(s->counter, BLOCK_FIELD_IS_BYREF);
+}
+
+static void countRetain(const void *object __unused) { ++retains; }
+static void countRelease(const void *object __unused) { --retains; }
+static void destructInstance(const void *object __unused) { }
+
+// 1 个 strong，1 个非对象字，1 个 byref
+static struct layout_descriptor strongLayout = {
+    0, sizeof(struct layout_block), layout_copy, layout_dispose, "v8@?0", "\x30\x20\x40"
+};
+// 多一个 weak，解释器不处理
+static struct layout_descriptor weakLayout = {
+    0, sizeof(struct layout_block), layout_copy, layout_dispose, "v8@?0", "\x30\x20\x40\x50"
+};
+
+static struct layout_descriptor objectLayout = {
+    0, sizeof(struct layout_block), object_copy, object_dispose, "v8@?0", "\x30\x20\x40"
+};
+
+// 只要有 isa 就行，runtime 不会给它发消息
+static struct { void *isa; } object = { &object };
+
+static void runObject(void *captured, int expectedHelperCalls) {
+    struct byref_long counter = { NULL, &counter, 0, sizeof(counter), 2 };
+    struct layout_block stack = {
+        _NSConcreteStackBlock,
+        BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_SIGNATURE | BLOCK_HAS_EXTENDED_LAYOUT,
+        0, NULL, &objectLayout, captured, 7, &counter
+    };
+
+    helperCalls = 0;
+    retains = 0;
+    struct layout_block *copy = (struct layout_block *)_Block_copy(&stack);
+    if (helperCalls != expectedHelperCalls) {
+        fail("copy helper called %d times, expected %d", helperCalls, expectedHelperCalls);
+    }
+    if (copy->inner != captured || retains != (captured ? 1 : 0)) {
+        fail("captured object was not retained");
+    }
+    _Block_release(copy);
+    if (helperCalls != 2 * expectedHelperCalls) {
+        fail("dispose helper called %d times, expected %d", helperCalls - expectedHelperCalls, expectedHelperCalls);
+    }
+    if (retains != 0) {
+        fail("captured object was not released");
+    }
+    _Block_object_dispose(&counter, BLOCK_FIELD_IS_BYREF);
+}
+
+static void run(struct layout_descriptor *descriptor, int expectedHelperCalls) {
+    long base = 40;
+    void (^inner)(void) = ^{ (void)base; };
+    struct byref_long counter = { NULL, &counter, 0, sizeof(counter), 2 };
+    struct layout_block stack = {
+        _NSConcreteStackBlock,
+        BLOCK_HAS_COPY_DISPOSE | BLOCK_HAS_SIGNATURE | BLOCK_HAS_EXTENDED_LAYOUT,
+        0, NULL, descriptor, (void *)inner, 7, &counter
+    };
+
+    helperCalls = 0;
+    struct layout_block *copy = (struct layout_block *)_Block_copy(&stack);
+    if (helperCalls != expectedHelperCalls) {
+        fail("copy helper called %d times, expected %d", helperCalls, expectedHelperCalls);
+    }
+    if (copy->inner == (void *)inner) {
+        fail("captured stack block was not copied");
+    }
+    if (copy->n != 7) {
+        fail("non-object capture was not copied");
+    }
+    if (copy->counter == &counter || counter.forwarding != copy->counter) {
+        fail("__block variable was not moved to the heap");
+    }
+    copy->counter->forwarding->value += 1;
+    if (counter.forwarding->value != 3) {
+        fail("__block variable is not shared");
+    }
+
+    _Block_release(copy);
+    if (helperCalls != 2 * expectedHelperCalls) {
+        fail("dispose helper called %d times, expected %d", helperCalls - expectedHelperCalls, expectedHelperCalls);
+    }
+    _Block_object_dispose(&counter, BLOCK_FIELD_IS_BYREF);
+}
+
+int main() {
+    run(&strongLayout, 0);
+    run(&weakLayout, 1);
+    runObject(&object, 1);
+    runObject(NULL, 0);
+    Block_callbacks_RR callbacks = { sizeof(callbacks), countRetain, countRelease, destructInstance };
+    _Block_use_RR2(&callbacks);
+    runObject(&object, 0);
+    succeed(__FILE__);
+}
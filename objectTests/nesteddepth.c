@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 一条很长的 continuation 链：每个 block 引入前一个栈上的 block。
+// 拷贝最后一个会拷贝整条链，释放它会销毁整条链，嵌套的拷贝和销毁不再递归，不能把栈用光。
+// dispose helper 用 _Block_release_many() 释放里面的 block 时也一样。
+// copy helper 中直接调用 Block_copy（好比 C++ 的拷贝构造函数）时不能推迟，返回时要已经拷贝完。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define DEPTH 300000
+
+struct link_block {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void (*invoke)(void *, ...);
+    struct link_descriptor *descriptor;
+    void *next;
+};
+
+struct link_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+};
+
+static long disposed;
+
+static void link_copy(void *dst, const void *src) {
+    struct link_block *d = (struct link_block *)dst;
+    const struct link_block *s = (const struct link_block *)src;
+    _Block_object_assign(&d->next, s->next, BLOCK_FIELD_IS_BLOCK);
+}
+
+static void link_dispose(const void *src) {
+    const struct link_block *s = (const struct link_block *)src;
+    ++disposed;
+    _Block_object_dispose(s->next, BLOCK_FIELD_IS_BLOCK);
+}
+
+static struct link_descriptor descriptor = {
+    0, sizeof(struct link_block), link_copy, link_dispose
+};
+
+// 像容器一样批量释放引入的 block
+static void link_dispose_many(const void *src) {
+    const struct link_block *s = (const struct link_block *)src;
+    ++disposed;
+    _Block_release_many((const void **)&s->next, 1);
+}
+
+static struct link_descriptor batchDescriptor = {
+    0, sizeof(struct link_block), link_copy, link_dispose_many
+};
+
+// 拷贝一个引入了 helper 自己栈上的 block 的 block，helper 返回以后它们就失效了
+static void eager_copy(void *dst, const void *src) {
+    link_copy(dst, src);
+    struct link_block inner = { _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, NULL, &descriptor, NULL };
+    struct link_block outer = { _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, NULL, &descriptor, &inner };
+    struct link_block *copy = (struct link_block *)Block_copy(&outer);
+    if (copy->next == (void *)&inner || ((struct link_block *)copy->next)->isa != _NSConcreteMallocBlock) {
+        fail("Block_copy in a copy helper returned before copying");
+    }
+    Block_release(copy);
+}
+
+static struct link_descriptor eagerDescriptor = {
+    0, sizeof(struct link_block), eager_copy, link_dispose
+};
+
+int main() {
+    // 这些 block 的 isa 是栈上的 block，runtime 并不关心它们实际在哪里
+    struct link_block *chain = (struct link_block *)malloc(DEPTH * sizeof(struct link_block));
+    int value = 7;
+    void (^leaf)(void) = ^{ (void)value; };
+    for (long i = 0; i < DEPTH; i++) {
+        chain[i].isa = _NSConcreteStackBlock;
+        chain[i].flags = BLOCK_HAS_COPY_DISPOSE;
+        chain[i].reserved = 0;
+        chain[i].invoke = NULL;
+        chain[i].descriptor = &descriptor;
+        chain[i].next = i ? (void *)&chain[i - 1] : (void *)leaf;
+    }
+
+    struct link_block *copy = (struct link_block *)Block_copy(&chain[DEPTH - 1]);
+    struct link_block *cursor = copy;
+    for (long i = DEPTH - 1; i >= 0; i--) {
+        if (cursor == &chain[i] || cursor->isa != _NSConcreteMallocBlock) {
+            fail("link %ld was not copied", i);
+        }
+        cursor = (struct link_block *)cursor->next;
+    }
+    if ((void *)cursor == (void *)leaf || ((struct Block_layout *)cursor)->isa != _NSConcreteMallocBlock) {
+        fail("leaf was not copied");
+    }
+
+    Block_release(copy);
+    if (disposed != DEPTH) {
+        fail("disposed %ld of %d links", disposed, DEPTH);
+    }
+
+    for (long i = 0; i < DEPTH; i++) {
+        chain[i].descriptor = &batchDescriptor;
+    }
+    const void *batch[1] = { Block_copy(&chain[DEPTH - 1]) };
+    _Block_release_many(batch, 1);
+    if (disposed != 2 * DEPTH) {
+        fail("batch release disposed %ld of %d links", disposed - DEPTH, DEPTH);
+    }
+    free(chain);
+
+    disposed = 0;
+    struct link_block eager = { _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, NULL, &eagerDescriptor, NULL };
+    Block_release(Block_copy(&eager));
+    if (disposed != 3) {
+        fail("disposed %ld of 3 blocks", disposed);
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 生产者线程用 _Block_copy_to_node() 把 block 拷贝到消费者所在的 node 上，消费者运行并 release。
+// 同时比较有没有 node 提示时消费者读取被引入变量的时间，VERBOSE=1 时打印出来。
+// 在多 socket 的机器上可以用 numactl --cpunodebind=0 和 --cpunodebind=1 分别运行两个线程来观察差别。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 20000
+#define PASSES 16
+
+typedef long (^LongBlock)(void);
+
+static LongBlock queue[COUNT];
+static volatile int consumerNode = -1;
+static volatile long produced;
+static bool useHint;
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static void *producer(void *arg __unused) {
+    while (consumerNode < 0) { }
+    for (long i = 0; i < COUNT; ++i) {
+        __block long counter = i;
+        long a = i, b = 2 * i, c = 3 * i;
+        LongBlock stack = ^{ return ++counter + a + b + c; };
+        queue[i] = useHint ? _Block_copy_to_node(stack, consumerNode) : Block_copy(stack);
+    }
+    __sync_synchronize();
+    produced = 1;
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    uint64_t *elapsed = (uint64_t *)arg;
+    consumerNode = _Block_current_numa_node();
+    while (!produced) { }
+    __sync_synchronize();
+
+    uint64_t start = now();
+    for (int pass = 0; pass < PASSES; ++pass) {
+        for (long i = 0; i < COUNT; ++i) {
+            if (queue[i]() != 6 * i + 1 + pass) {
+                fail("block %ld has bad captures", i);
+            }
+        }
+    }
+    *elapsed = now() - start;
+
+    for (long i = 0; i < COUNT; ++i) {
+        Block_release(queue[i]);
+    }
+    return NULL;
+}
+
+static uint64_t run(bool hint) {
+    pthread_t p, c;
+    uint64_t elapsed = 0;
+
+    useHint = hint;
+    consumerNode = -1;
+    produced = 0;
+    pthread_create(&c, NULL, consumer, &elapsed);
+    pthread_create(&p, NULL, producer, NULL);
+    pthread_join(p, NULL);
+    pthread_join(c, NULL);
+    return elapsed;
+}
+
+int main() {
+    int node = _Block_current_numa_node();
+    if (node < 0) {
+        fail("bad NUMA node %d", node);
+    }
+
+    uint64_t plain = run(false);
+    uint64_t placed = run(true);
+    testprintf("node %d: Block_copy %llu us, _Block_copy_to_node %llu us\n",
+               node, (unsigned long long)plain, (unsigned long long)placed);
+
+    // out-of-range nodes fall back to a plain copy
+    long a = 42;
+    LongBlock block = _Block_copy_to_node(^{ return a; }, -1);
+    if (block() != 42) {
+        fail("fallback copy has bad captures");
+    }
+    Block_release(block);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 手写的 copy/dispose helper 用 _Block_object_assign_inline() / _Block_object_dispose_inline()，
+// flags 是常量，直接调用按 flags 特化的入口。检查结果和通用的 _Block_object_assign() 一样。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+struct byref_int {
+    void *isa;
+    struct byref_int *forwarding;
+    volatile int32_t flags;
+    uint32_t size;
+    int value;
+};
+
+struct helper_block {
+    void *isa;
+    volatile int32_t flags;
+    int32_t reserved;
+    void (*invoke)(void *, ...);
+    struct helper_descriptor *descriptor;
+    void *inner;
+    struct byref_int *counter;
+    void *object;
+};
+
+struct helper_descriptor {
+    uintptr_t reserved;
+    uintptr_t size;
+    void (*copy)(void *dst, const void *src);
+    void (*dispose)(const void *);
+};
+
+static int retains, releases;
+
+static void retain(const void *object __unused) { ++retains; }
+static void release(const void *object __unused) { ++releases; }
+static void destructInstance(const void *object __unused) { }
+
+static void helper_copy(void *dst, const void *src) {
+    struct helper_block *d = (struct helper_block *)dst;
+    const struct helper_block *s = (const struct helper_block *)src;
+    _Block_object_assign_inline(&d->inner, s->inner, BLOCK_FIELD_IS_BLOCK);
+    _Block_object_assign_inline(&d->counter, s->counter, BLOCK_FIELD_IS_BYREF);
+    _Block_object_assign_inline(&d->object, s->object, BLOCK_FIELD_IS_OBJECT);
+}
+
+static void helper_dispose(const void *src) {
+    const struct helper_block *s = (const struct helper_block *)src;
+    _Block_object_dispose_inline(s->inner, BLOCK_FIELD_IS_BLOCK);
+    _Block_object_dispose_inline(s->counter, BLOCK_FIELD_IS_BYREF);
+    _Block_object_dispose_inline(s->object, BLOCK_FIELD_IS_OBJECT);
+}
+
+static struct helper_descriptor descriptor = {
+    0, sizeof(struct helper_block), helper_copy, helper_dispose
+};
+
+int main() {
+    Block_callbacks_RR callbacks = { sizeof(callbacks), retain, release, destructInstance };
+    _Block_use_RR2(&callbacks);
+
+    int x = 3;
+    void (^inner)(void) = ^{ (void)x; };
+    struct byref_int counter = { NULL, &counter, 0, sizeof(counter), 4 };
+    int object;
+    struct helper_block stack = {
+        _NSConcreteStackBlock, BLOCK_HAS_COPY_DISPOSE, 0, NULL, &descriptor,
+        (void *)inner, &counter, &object
+    };
+
+    struct helper_block *copy = (struct helper_block *)_Block_copy(&stack);
+    if (copy->inner == (void *)inner) {
+        fail("captured block was not copied");
+    }
+    if (copy->counter == &counter || counter.forwarding != copy->counter) {
+        fail("__block variable was not moved to the heap");
+    }
+    if (copy->object != &object || retains != 1) {
+        fail("object was not retained");
+    }
+
+    _Block_release(copy);
+    if (releases != 1) {
+        fail("object was not released");
+    }
+    _Block_object_dispose(&counter, BLOCK_FIELD_IS_BYREF);
+
+    // flags 不是常量时走通用的入口
+    volatile int flags = BLOCK_FIELD_IS_OBJECT;
+    void *slot = NULL;
+    _Block_object_assign_inline(&slot, &object, flags);
+    _Block_object_dispose_inline(slot, flags);
+    if (slot != &object || retains != 2 || releases != 2) {
+        fail("generic entry point gave a different result");
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 几个线程同时 retain/release 同一个 block，比较 runtime 的快速路径
+// 和以前的 CAS 循环（在这里照原样实现一份，作用在一个普通的计数上）的耗时，VERBOSE=1 时打印出来。
+// 最后 block 仍然要被正确释放。
+// 然后让引用计数停在 side table 的边界附近（flags 中只剩几个，其余在 side table 中），几个线程同时先 release 再 retain，
+// 中间值不能被别的线程看到，否则会有 release 被当成 underflow 丢掉，block 泄漏。
+// 再让引用计数停在 fetch_add 快速路径的边界（BLOCK_REFCOUNT_MASK 的一半）附近，几个线程同时 retain 再 release，
+// 快速路径和 CAS 循环交替着用，最后也要平衡。
+// 最后每个线程各持有一个引用同时 release，fetch_sub 减到 0 的线程必须正好销毁一次。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define THREADS 8
+#define ITERATIONS 1000000
+#define EDGE_ROUNDS 50
+#define EDGE_ITERATIONS 20000
+#define HALF_ROUNDS 50
+#define LAST_ROUNDS 2000
+
+typedef long (^LongBlock)(void);
+
+static LongBlock shared;
+static LongBlock edge;
+static LongBlock half;
+static LongBlock last;
+static volatile int32_t legacyFlags = BLOCK_NEEDS_FREE | 2;
+static volatile int start;
+
+static uint64_t now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+// 以前的 latching_incr_int / latching_decr_int_should_deallocate
+static void legacy_retain(volatile int32_t *where) {
+    while (1) {
+        int32_t old_value = *where;
+        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) return;
+        if (__sync_bool_compare_and_swap(where, old_value, old_value+2)) return;
+    }
+}
+
+static void legacy_release(volatile int32_t *where) {
+    while (1) {
+        int32_t old_value = *where;
+        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) return;
+        if ((old_value & BLOCK_REFCOUNT_MASK) == 0) return;
+        int32_t new_value = old_value - 2;
+        if ((old_value & (BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING)) == 2) new_value = old_value - 1;
+        if (__sync_bool_compare_and_swap(where, old_value, new_value)) return;
+    }
+}
+
+static void *runtimeWorker(void *arg __unused) {
+    while (!start) { }
+    for (int i = 0; i < ITERATIONS; ++i) {
+        Block_copy(shared);
+        Block_release(shared);
+    }
+    return NULL;
+}
+
+static void *legacyWorker(void *arg __unused) {
+    while (!start) { }
+    for (int i = 0; i < ITERATIONS; ++i) {
+        legacy_retain(&legacyFlags);
+        legacy_release(&legacyFlags);
+    }
+    return NULL;
+}
+
+static void *edgeWorker(void *arg __unused) {
+    while (!start) { }
+    for (int i = 0; i < EDGE_ITERATIONS; ++i) {
+        Block_release(edge);
+        Block_copy(edge);
+    }
+    return NULL;
+}
+
+static void *halfWorker(void *arg __unused) {
+    while (!start) { }
+    for (int i = 0; i < EDGE_ITERATIONS; ++i) {
+        Block_copy(half);
+        Block_release(half);
+    }
+    return NULL;
+}
+
+static void *lastWorker(void *arg __unused) {
+    while (!start) { }
+    Block_release(last);
+    return NULL;
+}
+
+static int32_t refcountFlags(LongBlock block) {
+    return ((struct Block_layout *)block)->flags;
+}
+
+static int32_t edgeFlags(void) {
+    return refcountFlags(edge);
+}
+
+static uint64_t heapFrees(void) {
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    return stats.frees;
+}
+
+static uint64_t contend(void *(*worker)(void *)) {
+    pthread_t threads[THREADS];
+    start = 0;
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_create(&threads[i], NULL, worker, NULL);
+    }
+    uint64_t begin = now();
+    start = 1;
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    return now() - begin;
+}
+
+int main() {
+    long a = 1;
+    shared = Block_copy(^{ return a; });
+
+    uint64_t legacy = contend(legacyWorker);
+    uint64_t fast = contend(runtimeWorker);
+    testprintf("%d threads x %d retain/release: CAS loop %llu us, runtime %llu us\n",
+               THREADS, ITERATIONS, (unsigned long long)legacy, (unsigned long long)fast);
+
+    if ((legacyFlags & BLOCK_REFCOUNT_MASK) != 2) {
+        fail("legacy counter is unbalanced");
+    }
+    if ((((struct Block_layout *)shared)->flags & BLOCK_REFCOUNT_MASK) != 2) {
+        fail("block refcount is unbalanced after contention");
+    }
+
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    uint64_t frees = stats.frees;
+    Block_release(shared);
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    if (stats.frees != frees + 1) {
+        fail("block was not freed after the last release");
+    }
+
+    // biased 的引用计数不在 flags 中
+    _Block_use_biased_refcounts(false);
+    edge = Block_copy(^{ return a + 1; });
+    for (int round = 0; round < EDGE_ROUNDS; ++round) {
+        // 把引用计数推过 side table 的边界，再降到 flags 中只剩 THREADS + 1 个
+        long extra = 0;
+        while (!(edgeFlags() & BLOCK_REFCOUNT_SPILLED)) {
+            Block_copy(edge);
+            extra++;
+        }
+        while ((edgeFlags() & BLOCK_REFCOUNT_MASK) > 2 * (THREADS + 1)) {
+            Block_release(edge);
+            extra--;
+        }
+        contend(edgeWorker);
+        while (extra--) {
+            Block_release(edge);
+        }
+        if ((edgeFlags() & (BLOCK_REFCOUNT_MASK|BLOCK_REFCOUNT_SPILLED)) != 2) {
+            fail("refcount is unbalanced after contention at the side table edge (flags %#x)", edgeFlags());
+        }
+    }
+
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    frees = stats.frees;
+    Block_release(edge);
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    if (stats.frees != frees + 1) {
+        fail("block at the side table edge was not freed after the last release");
+    }
+
+    half = Block_copy(^{ return a + 2; });
+    for (int round = 0; round < HALF_ROUNDS; ++round) {
+        // 停在快速路径边界下面几个，每个线程的 retain 都可能越过边界
+        long extra = 0;
+        while ((refcountFlags(half) & BLOCK_REFCOUNT_MASK) < BLOCK_REFCOUNT_MASK / 2 - 2 * (THREADS / 2)) {
+            Block_copy(half);
+            extra++;
+        }
+        contend(halfWorker);
+        if (refcountFlags(half) & BLOCK_REFCOUNT_SPILLED) {
+            fail("refcount spilled at the fast path edge (flags %#x)", refcountFlags(half));
+        }
+        while (extra--) {
+            Block_release(half);
+        }
+        if ((refcountFlags(half) & BLOCK_REFCOUNT_MASK) != 2) {
+            fail("refcount is unbalanced after contention at the fast path edge (flags %#x)", refcountFlags(half));
+        }
+    }
+    frees = heapFrees();
+    Block_release(half);
+    if (heapFrees() != frees + 1) {
+        fail("block at the fast path edge was not freed after the last release");
+    }
+
+    for (int round = 0; round < LAST_ROUNDS; ++round) {
+        last = Block_copy(^{ return a + round; });
+        for (int i = 1; i < THREADS; ++i) {
+            Block_copy(last);
+        }
+        frees = heapFrees();
+        contend(lastWorker);
+        if (heapFrees() != frees + 1) {
+            fail("concurrent last releases freed the block %llu times", (unsigned long long)(heapFrees() - frees));
+        }
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 引用计数超过 flags 中 15 位能存的范围以后，block 和 __block 变量不能再锁死，
+// 全部 release 以后仍然要被释放。几个线程同时在溢出的边界上 retain/release 也不能出错。
+
+#include <stdio.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define RETAINS 100000
+#define THREADS 4
+
+typedef long (^LongBlock)(void);
+
+static LongBlock shared;
+
+static uint64_t blockFrees(void) {
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    return stats.frees;
+}
+
+static void *churn(void *arg __unused) {
+    for (int i = 0; i < RETAINS; ++i) {
+        Block_copy(shared);
+    }
+    for (int i = 0; i < RETAINS; ++i) {
+        Block_release(shared);
+    }
+    return NULL;
+}
+
+int main() {
+    __block long counter = 0;
+    long a = 1;
+    LongBlock block = Block_copy(^{ return ++counter + a; });
+
+    for (int i = 0; i < RETAINS; ++i) {
+        if (Block_copy(block) != block) {
+            fail("retain of a heap block returned a new block");
+        }
+    }
+    if ((((struct Block_layout *)block)->flags & BLOCK_REFCOUNT_SPILLED) == 0) {
+        fail("refcount did not spill to the side table");
+    }
+
+    uint64_t frees = blockFrees();
+    for (int i = 0; i < RETAINS; ++i) {
+        Block_release(block);
+    }
+    if (blockFrees() != frees) {
+        fail("block was freed while still retained");
+    }
+    if (block() != 2) {
+        fail("block has bad captures after the refcount came back inline");
+    }
+    Block_release(block);
+    if (blockFrees() != frees + 1) {
+        fail("block leaked after its refcount overflowed");
+    }
+
+    // several threads crossing the spill boundary at the same time
+    shared = Block_copy(^{ return ++counter + a; });
+    pthread_t threads[THREADS];
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_create(&threads[i], NULL, churn, NULL);
+    }
+    for (int i = 0; i < THREADS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    if (((struct Block_layout *)shared)->flags & BLOCK_REFCOUNT_SPILLED) {
+        fail("side table entry outlived the extra retains");
+    }
+    frees = blockFrees();
+    Block_release(shared);
+    if (blockFrees() != frees + 1) {
+        fail("shared block leaked after its refcount overflowed");
+    }
+
+    succeed(__FILE__);
+}
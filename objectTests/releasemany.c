@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// _Block_release_many() 和逐个 Block_release 的效果一样：还有别的引用的 block 不销毁，
+// 全局 block 和 NULL 直接跳过，__block 变量照常由 dispose helper 释放。
+// 在别的线程上批量 release 时，内存要还给拷贝它的线程。
+
+#include <stdio.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 1000
+
+typedef long (^LongBlock)(void);
+
+static const void *handlers[COUNT];
+
+static uint64_t blockFrees(void) {
+    Block_heap_statistics stats = { sizeof(stats) };
+    _Block_get_heap_statistics(BLOCK_HEAP_BLOCKS, &stats);
+    return stats.frees;
+}
+
+static void fill(void) {
+    for (long i = 0; i < COUNT; ++i) {
+        long a = i;
+        if (i % 2) {
+            handlers[i] = Block_copy(^{ return a; });
+        } else {
+            __block long counter = i;
+            handlers[i] = Block_copy(^{ return ++counter + a; });
+        }
+    }
+}
+
+static void *drain(void *arg __unused) {
+    _Block_release_many(handlers, COUNT);
+    return NULL;
+}
+
+int main() {
+    fill();
+    LongBlock kept = Block_copy((LongBlock)handlers[1]);
+    Block_release(handlers[2]);
+    Block_release(handlers[4]);
+    handlers[2] = NULL;
+    handlers[4] = ^{ return 4L; };
+
+    uint64_t frees = blockFrees();
+    _Block_release_many(handlers, COUNT);
+    if (blockFrees() != frees + COUNT - 3) {
+        fail("batch freed %llu blocks, expected %d",
+             (unsigned long long)(blockFrees() - frees), COUNT - 3);
+    }
+    if (kept() != 1) {
+        fail("retained block was destroyed by the batch");
+    }
+    Block_release(kept);
+
+    fill();
+    pthread_t t;
+    pthread_create(&t, NULL, drain, NULL);
+    pthread_join(t, NULL);
+
+    // slots returned across threads are reused here
+    fill();
+    for (long i = 0; i < COUNT; ++i) {
+        if (((LongBlock)handlers[i])() != (i % 2 ? i : 2 * i + 1)) {
+            fail("block %ld has bad captures", i);
+        }
+    }
+    _Block_release_many(handlers, COUNT);
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 装了 retain/release 的 callout 以后，拷贝 block 时要调用它们；
+// _Block_seal_callouts() 以后再装别的 callout 会被忽略。
+
+#include <stdio.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+static int retains, releases, ignored;
+
+static void retain(const void *object __unused) { ++retains; }
+static void release(const void *object __unused) { ++releases; }
+static void other(const void *object __unused) { ++ignored; }
+static void destructInstance(const void *object __unused) { }
+
+int main() {
+    void *slot = NULL;
+    int object;
+
+    Block_callbacks_RR callbacks = { sizeof(callbacks), retain, release, destructInstance };
+    _Block_use_RR2(&callbacks);
+    _Block_object_assign(&slot, &object, BLOCK_FIELD_IS_OBJECT);
+    if (slot != &object || retains != 1) {
+        fail("retain callout was not called");
+    }
+    _Block_object_dispose(slot, BLOCK_FIELD_IS_OBJECT);
+    if (releases != 1) {
+        fail("release callout was not called");
+    }
+
+    _Block_seal_callouts();
+    Block_callbacks_RR replacement = { sizeof(replacement), other, other, destructInstance };
+    _Block_use_RR2(&replacement);
+    _Block_object_assign(&slot, &object, BLOCK_FIELD_IS_OBJECT);
+    _Block_object_dispose(slot, BLOCK_FIELD_IS_OBJECT);
+    if (retains != 2 || releases != 2 || ignored != 0) {
+        fail("callouts changed after _Block_seal_callouts()");
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 堆上的小 block 从 slab 中分配，释放后会被复用。
+// 拷贝不同大小的 block，检查被引入的变量都还在，并且地址是 16 字节对齐的。
+
+#include <stdio.h>
+#include <stdint.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+typedef long (^SumBlock)(void);
+
+static SumBlock copied[64];
+
+static void check(SumBlock block, long expected) {
+    if (((uintptr_t)(void *)block & 15) != 0) {
+        fail("heap block %p is not 16-byte aligned", (void *)block);
+    }
+    if (block() != expected) {
+        fail("heap block lost its captured values");
+    }
+}
+
+int main() {
+    long a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7, h = 8;
+    char big[300] = { 9 };
+
+    for (int round = 0; round < 100; ++round) {
+        int n = 0;
+        copied[n++] = Block_copy(^{ return a; });
+        copied[n++] = Block_copy(^{ return a + b; });
+        copied[n++] = Block_copy(^{ return a + b + c; });
+        copied[n++] = Block_copy(^{ return a + b + c + d + e; });
+        copied[n++] = Block_copy(^{ return a + b + c + d + e + f + g + h; });
+        copied[n++] = Block_copy(^{ return (long)big[0] + a; });
+
+        check(copied[0], 1);
+        check(copied[1], 3);
+        check(copied[2], 6);
+        check(copied[3], 15);
+        check(copied[4], 36);
+        check(copied[5], 10);
+
+        // retain again, only the last release gives the memory back
+        SumBlock again = Block_copy(copied[2]);
+        if (again != copied[2]) {
+            fail("copying a heap block made a new copy");
+        }
+        Block_release(again);
+        check(copied[2], 6);
+
+        for (int i = 0; i < n; ++i) {
+            Block_release(copied[i]);
+        }
+    }
+
+    succeed(__FILE__);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2010 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LLVM_LICENSE_HEADER@
+ */
+
+// TEST_CONFIG
+
+// 生产者线程拷贝 block 和 __block 变量，消费者线程 release，
+// 内存要还给生产者线程的 magazine，之后在两边继续拷贝都不能出错。
+
+#include <stdio.h>
+#include <pthread.h>
+#include <Block.h>
+#include <Block_private.h>
+#include "test.h"
+
+#define COUNT 10000
+
+typedef long (^LongBlock)(void);
+
+static LongBlock queue[COUNT];
+static volatile long produced;
+
+static void *producer(void *arg __unused) {
+    for (long i = 0; i < COUNT; ++i) {
+        __block long counter = i;
+        long a = i, b = 2 * i;
+        queue[i] = Block_copy(^{ return ++counter + a + b; });
+        __sync_synchronize();
+        produced = i + 1;
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg __unused) {
+    for (long i = 0; i < COUNT; ++i) {
+        while (produced <= i) { }
+        __sync_synchronize();
+        if (queue[i]() != 4 * i + 1) {
+            fail("block %ld has bad captures", i);
+        }
+        Block_release(queue[i]);
+    }
+    return NULL;
+}
+
+int main() {
+    for (int round = 0; round < 4; ++round) {
+        pthread_t p, c;
+        produced = 0;
+        pthread_create(&p, NULL, producer, NULL);
+        pthread_create(&c, NULL, consumer, NULL);
+        pthread_join(p, NULL);
+        pthread_join(c, NULL);
+    }
+
+    // same-thread copy/release after all the cross-thread traffic
+    for (long i = 0; i < COUNT; ++i) {
+        long a = i;
+        LongBlock block = Block_copy(^{ return a; });
+        if (block() != i) {
+            fail("reused slot has bad captures");
+        }
+        Block_release(block);
+    }
+
+    succeed(__FILE__);
+}
@@ -8,12 +8,29 @@
  */
 
 
+#if __linux__ && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE 1 // dl_iterate_phdr()
+#endif
 #include "Block_private.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <dlfcn.h>
+#if !TARGET_OS_WIN32
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#endif
+#if __APPLE__
+#include <mach/vm_statistics.h>
+#include <mach-o/dyld.h>
+#endif
+#if __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <link.h>
+#endif
 #if TARGET_IPHONE_SIMULATOR
 // workaround: 10682842
 #define os_assumes(_x) (_x)
@@ -48,6 +65,11 @@ static __inline bool OSAtomicCompareAndSwapInt(int oldi, int newi, int volatile
 // __sync_bool_compare_and_swap 是 GCC 内建的原子操作函数， 执行CAS操作，也就是 比较 _Ptr 和 _Old 如果相等就将 _New 放到 _Ptr 中，并且返回true，否则返回false。
 #define OSAtomicCompareAndSwapLong(_Old, _New, _Ptr) __sync_bool_compare_and_swap(_Ptr, _Old, _New)
 #define OSAtomicCompareAndSwapInt(_Old, _New, _Ptr) __sync_bool_compare_and_swap(_Ptr, _Old, _New)
+#define OSAtomicCompareAndSwapPtr(_Old, _New, _Ptr) __sync_bool_compare_and_swap(_Ptr, _Old, _New)
+
+// flags 不是 _Atomic 类型（它在 ABI 中就是 int32_t），引用计数的快速路径把它当成 _Atomic 来操作
+#define BLOCK_ATOMIC_FLAGS(_where) ((volatile _Atomic(int32_t) *)(_where))
+#define BLOCK_REFCOUNT_FAST_PATH 1
 #endif
 
 
@@ -67,21 +89,134 @@ static int _Block_copy_flag = BLOCK_NEEDS_FREE;
 // 引用计数是 2 的原因见 _Block_byref_assign_copy()
 static int _Byref_flag_initial_value = BLOCK_BYREF_NEEDS_FREE | 4; // logical 2
 
+// 编译时定义 BLOCK_STATIC_CALLOUTS=1，去掉 GC 和 retain/release 的 callout，见 Direct callouts
+#ifndef BLOCK_STATIC_CALLOUTS
+#define BLOCK_STATIC_CALLOUTS 0
+#endif
+
+#if BLOCK_STATIC_CALLOUTS
+#define isGC false // 常量，GC 的分支都会被编译器去掉
+#else
 static bool isGC = false; // 默认是不使用 GC
+#endif
 
 /*******************************************************************************
 Internal Utilities 内部的工具函数
 ********************************************************************************/
 
-// 引用计数加 1，最多不超过 BLOCK_REFCOUNT_MASK
+/*
+ 引用计数溢出的处理
+ 
+ flags 中只有 15 位用来存引用计数，以前引用计数满了以后就锁死在 BLOCK_REFCOUNT_MASK，block 再也不会被释放。
+ 现在引用计数快满时，把其中 BLOCK_REFCOUNT_SPILL 个挪到一张以 flags 地址为 key 的 side table 中，
+ 并打上 BLOCK_REFCOUNT_SPILLED 标记；release 到 flags 中只剩 1 个时，再从 side table 中借回来，
+ side table 中的计数还完以后去掉标记。引用计数没满、或者没有溢出过时，加减仍然只是一次 CAS。
+ 
+ side table 只在溢出和借回时用到，所以用一个自旋锁保护就够了。
+*/
+
+#define BLOCK_REFCOUNT_SPILL 0x4000 // 每次挪到 side table 中的引用计数个数，是 flags 中能存的一半
+
+#ifndef BLOCK_REFCOUNT_FAST_PATH
+#define BLOCK_REFCOUNT_FAST_PATH 0
+#endif
+#define BLOCK_REFCOUNT_TABLE_SIZE 64
+
+struct Block_refcount_entry {
+    struct Block_refcount_entry *next;
+    volatile int32_t *where;
+    uintptr_t count;    // 挪到 side table 中的引用计数个数
+};
+
+static struct Block_refcount_entry *_Block_refcount_table[BLOCK_REFCOUNT_TABLE_SIZE];
+static volatile int32_t _Block_refcount_lock;
+
+static void _Block_refcount_table_lock(void) {
+    while (!OSAtomicCompareAndSwapInt(0, 1, &_Block_refcount_lock)) { }
+}
+
+static void _Block_refcount_table_unlock(void) {
+    OSAtomicCompareAndSwapInt(1, 0, &_Block_refcount_lock);
+}
+
+// 找到 where 在 side table 中的条目，没有的话，create 为 true 时新建一个
+static struct Block_refcount_entry **_Block_refcount_entry_find(volatile int32_t *where, bool create) {
+    struct Block_refcount_entry **entry = &_Block_refcount_table[((uintptr_t)where >> 4) % BLOCK_REFCOUNT_TABLE_SIZE];
+    while (*entry && (*entry)->where != where) {
+        entry = &(*entry)->next;
+    }
+    if (!*entry && create) {
+        *entry = (struct Block_refcount_entry *)calloc(1, sizeof(struct Block_refcount_entry));
+        if (*entry) (*entry)->where = where;
+    }
+    return entry;
+}
+
+// flags 中的引用计数快满了，把 BLOCK_REFCOUNT_SPILL 个挪到 side table 中，同时引用计数加 1
+// 返回 false 表示 CAS 失败，调用者需要重新读 flags 再试；side table 分配失败时退回以前的锁死行为
+static bool _Block_refcount_spill(volatile int32_t *where, int32_t old_value) {
+    bool result = false;
+    _Block_refcount_table_lock();
+    struct Block_refcount_entry **entry = _Block_refcount_entry_find(where, true);
+    if (!*entry) {
+        result = OSAtomicCompareAndSwapInt(old_value, old_value | BLOCK_REFCOUNT_MASK, where);
+    }
+    else if (OSAtomicCompareAndSwapInt(old_value, (old_value - 2*BLOCK_REFCOUNT_SPILL + 2) | BLOCK_REFCOUNT_SPILLED, where)) {
+        (*entry)->count += BLOCK_REFCOUNT_SPILL;
+        result = true;
+    }
+    _Block_refcount_table_unlock();
+    return result;
+}
+
+// flags 中只剩 1 个引用计数了，但是 side table 中还有，借回最多 BLOCK_REFCOUNT_SPILL 个，同时引用计数减 1
+// 借完了就去掉 BLOCK_REFCOUNT_SPILLED 标记。返回 false 表示 CAS 失败，调用者需要重新读 flags 再试
+static bool _Block_refcount_unspill(volatile int32_t *where, int32_t old_value) {
+    bool result = false;
+    _Block_refcount_table_lock();
+    struct Block_refcount_entry **entry = _Block_refcount_entry_find(where, false);
+    struct Block_refcount_entry *found = *entry;
+    os_assert(found && found->count);
+    uintptr_t borrow = found->count < BLOCK_REFCOUNT_SPILL ? found->count : BLOCK_REFCOUNT_SPILL;
+    int32_t new_value = old_value - 2 + 2*(int32_t)borrow;
+    if (borrow == found->count) new_value &= ~BLOCK_REFCOUNT_SPILLED;
+    if (OSAtomicCompareAndSwapInt(old_value, new_value, where)) {
+        found->count -= borrow;
+        if (found->count == 0) {
+            *entry = found->next;
+            free(found);
+        }
+        result = true;
+    }
+    _Block_refcount_table_unlock();
+    return result;
+}
+
+// 引用计数加 1，快满时把一部分挪到 side table 中
+// 只有 side table 分配失败时才会锁死在 BLOCK_REFCOUNT_MASK
 // volatile的作用是：作为指令关键字，确保本条指令不会因编译器的优化而省略，且要求每次直接读值。简单地说就是防止编译器对代码进行优化
 static int32_t latching_incr_int(volatile int32_t *where) {
+#if BLOCK_REFCOUNT_FAST_PATH
+    // 引用计数不到一半时直接 fetch_add，retain 不需要和别的内存操作排序，用 relaxed。
+    // 读到的值和 fetch_add 之间别的线程也可能加，但是每个线程最多多加 1 个，
+    // 要上万个线程同时在这个窗口中才会加到 BLOCK_REFCOUNT_MASK - 2（挪到 side table 的边界）。快满了走下面的循环
+    if ((*where & BLOCK_REFCOUNT_MASK) < BLOCK_REFCOUNT_MASK / 2) {
+        return atomic_fetch_add_explicit(BLOCK_ATOMIC_FLAGS(where), 2, memory_order_relaxed) + 2;
+    }
+#endif
     while (1) {
         int32_t old_value = *where;
-        // 如果 old_value 在第 1~15 位都已经变为 1 了，即引用计数已经满了，就返回 BLOCK_REFCOUNT_MASK
+        // 如果 old_value 在第 1~15 位都已经变为 1 了，即引用计数已经锁死了，就返回 BLOCK_REFCOUNT_MASK
         if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
             return BLOCK_REFCOUNT_MASK;
         }
+        // 再加 1 就满了，挪一部分到 side table 中
+        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK - 2) {
+            if (_Block_refcount_spill(where, old_value)) {
+                return *where;
+            }
+            continue;
+        }
         // 比较 where 处的现在的值是否等于 old_value，如果等于，就将新值 oldValue + 2 放入 where
         // 否则继续下一轮循环
         // 这里加 2，是因为 flag 的第 0 位已经被占了，引用计数是第 1~15 位，所以加上 0b10，引用计数只是加 1
@@ -92,6 +227,29 @@ static int32_t latching_incr_int(volatile int32_t *where) {
     }
 }
 
+// 引用计数加 n。离满还很远时用一次 CAS 加上，否则一个一个加（中途可能挪到 side table 中）
+// 调用者：_Block_copy_n()
+static void latching_add_int(volatile int32_t *where, size_t n) {
+    if (n < BLOCK_REFCOUNT_SPILL) {
+        int32_t delta = 2 * (int32_t)n;
+        while (1) {
+            int32_t old_value = *where;
+            if ((old_value & BLOCK_REFCOUNT_MASK) + delta >= BLOCK_REFCOUNT_MASK - 2) break;
+#if BLOCK_REFCOUNT_FAST_PATH
+            // 和 latching_incr_int() 一样，离满还有一半时直接加
+            if ((old_value & BLOCK_REFCOUNT_MASK) + delta < BLOCK_REFCOUNT_MASK / 2) {
+                atomic_fetch_add_explicit(BLOCK_ATOMIC_FLAGS(where), delta, memory_order_relaxed);
+                return;
+            }
+#endif
+            if (OSAtomicCompareAndSwapInt(old_value, old_value+delta, where)) return;
+        }
+    }
+    while (n--) {
+        latching_incr_int(where);
+    }
+}
+
 // 当 block 不是处于 dealloc 时，引用计数加 1
 // 返回值是是否成功，只有在 block 处于 dealloc 时，才会失败
 static bool latching_incr_int_not_deallocating(volatile int32_t *where) {
@@ -106,6 +264,13 @@ static bool latching_incr_int_not_deallocating(volatile int32_t *where) {
             // if latched, we're leaking this block, and we succeed
             return true;
         }
+        // 再加 1 就满了，挪一部分到 side table 中
+        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK - 2) {
+            if (_Block_refcount_spill(where, old_value)) {
+                return true;
+            }
+            continue;
+        }
         // 引用计数加 1，这里 old_value+2 的原因和 latching_incr_int 一致
         // 如果失败，进行下一轮循环
         if (OSAtomicCompareAndSwapInt(old_value, old_value+2, where)) {
@@ -120,9 +285,29 @@ static bool latching_incr_int_not_deallocating(volatile int32_t *where) {
 // 引用计数减 1，如果引用计数减到了 0，就将 block 置为 deallocating 状态
 // 返回值是 block 是否需要被 dealloc
 static bool latching_decr_int_should_deallocate(volatile int32_t *where) {
+#if BLOCK_REFCOUNT_FAST_PATH
+    // 至少还有 2 个引用、没有挪到 side table、没有锁死时直接 fetch_sub，用 release
+    // 保证这个线程之前对 block 的读写都在最后一个 release 的线程销毁它之前完成。
+    // 同时 release 的线程各自持有一个引用，所以减到 0 的一定是最后一个引用，不会有别的线程看到 0 以后再减；
+    // 读到的值和 fetch_sub 之间别的线程把其他引用都释放了时，这里减到 0，由它自己设置 BLOCK_DEALLOCATING。
+    // （同一个窗口中 BLOCK_REFCOUNT_SPILLED 被设置上需要上万个线程同时 retain，和 latching_incr_int() 的前提一样）
+    int32_t observed = *where;
+    if ((observed & BLOCK_REFCOUNT_MASK) > 2 && (observed & BLOCK_REFCOUNT_MASK) != BLOCK_REFCOUNT_MASK
+        && !(observed & BLOCK_REFCOUNT_SPILLED)) {
+        observed = atomic_fetch_sub_explicit(BLOCK_ATOMIC_FLAGS(where), 2, memory_order_release);
+        if ((observed & BLOCK_REFCOUNT_MASK) != 2) return false;
+        // 减到 0 了。_Block_tryRetain() 可能在这之间又 retain 了，那样就由它之后的 release 销毁
+        atomic_thread_fence(memory_order_acquire);
+        while (1) {
+            int32_t old_value = *where;
+            if (old_value & (BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING)) return false;
+            if (OSAtomicCompareAndSwapInt(old_value, old_value|BLOCK_DEALLOCATING, where)) return true;
+        }
+    }
+#endif
     while (1) {
         int32_t old_value = *where;
-        // 如果引用计数还是满的，就不能 dealloc，#疑问：引用计数满了以后就不能减了么
+        // 引用计数锁死了，就不能 dealloc。只有 side table 分配失败时才会这样
         if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
             return false; // latched high
         }
@@ -130,6 +315,13 @@ static bool latching_decr_int_should_deallocate(volatile int32_t *where) {
         if ((old_value & BLOCK_REFCOUNT_MASK) == 0) {
             return false;   // underflow, latch low
         }
+        // flags 中只剩 1 个了，但是 side table 中还有，从 side table 中借回来
+        if ((old_value & (BLOCK_REFCOUNT_MASK|BLOCK_REFCOUNT_SPILLED)) == (2|BLOCK_REFCOUNT_SPILLED)) {
+            if (_Block_refcount_unspill(where, old_value)) {
+                return false;
+            }
+            continue;
+        }
         int32_t new_value = old_value - 2; // 引用计数减 1
         bool result = false;
         // 如果 old_value 在 0~15 位的值是 0b10，即引用计数是 1，且不是 deallocating 状态
@@ -157,6 +349,13 @@ static bool latching_decr_int_now_zero(volatile int32_t *where) {
         if ((old_value & BLOCK_REFCOUNT_MASK) == 0) {
             return false;   // underflow, latch low
         }
+        // flags 中只剩 1 个了，但是 side table 中还有，从 side table 中借回来
+        if ((old_value & (BLOCK_REFCOUNT_MASK|BLOCK_REFCOUNT_SPILLED)) == (2|BLOCK_REFCOUNT_SPILLED)) {
+            if (_Block_refcount_unspill(where, old_value)) {
+                return false;
+            }
+            continue;
+        }
         int32_t new_value = old_value - 2; // 引用计数减 1
         if (OSAtomicCompareAndSwapInt(old_value, new_value, where)) {
             // 引用计数当前是否是 0
@@ -237,6 +436,65 @@ static void (*_Block_memmove)(void *dest, void *src, unsigned long size) = _Bloc
 static void (*_Block_destructInstance) (const void *aBlock) = _Block_destructInstance_default;
 
 
+/**************************************************************************
+Direct callouts
+ 
+ 上面这些 callout 只有调用了 _Block_use_GC() / _Block_use_RR() / _Block_use_RR2() 才会被换掉，
+ 在没有 Objective-C 和 CoreFoundation 的平台上一直是默认实现，每次拷贝和销毁却都要间接调用一遍什么也不干的函数。
+ 热路径上的调用都经过下面的 _Block_callout_*()：还没有换掉任何 callout 时直接执行默认实现（编译器会把它们内联掉），
+ 只剩一个很好预测的分支。
+ 
+ _Block_seal_callouts() 以后再也不能换掉 callout，之后的 _Block_use_GC() 等调用都被忽略，
+ 这样 sealed 之前 retain 的对象不会被之后才换上的 release 释放。
+ 编译时定义 BLOCK_STATIC_CALLOUTS=1 是给没有 Objective-C 的平台用的变种：isGC 是常量 false，
+ callout 一直是默认实现，GC 的分支和间接调用都在编译时去掉，_Block_use_GC() 等调用都被忽略。
+***************************************************************************/
+
+#if BLOCK_STATIC_CALLOUTS
+#define _Block_callouts_default true
+#define _Block_rr_callouts false
+#else
+static bool _Block_callouts_default = true; // 还没有换掉任何一个 callout
+static bool _Block_rr_callouts = false;     // 调用过 _Block_use_RR() / _Block_use_RR2()，对象的 retain/release 是真的
+#endif
+static bool _Block_callouts_sealed = false;
+
+static __inline void _Block_callout_retain_object(const void *ptr) {
+    if (!_Block_callouts_default) _Block_retain_object(ptr);
+}
+
+static __inline void _Block_callout_release_object(const void *ptr) {
+    if (!_Block_callouts_default) _Block_release_object(ptr);
+}
+
+static __inline void _Block_callout_destructInstance(const void *aBlock) {
+    if (!_Block_callouts_default) _Block_destructInstance(aBlock);
+}
+
+static __inline void _Block_callout_assign(void *value, void **destptr) {
+    if (_Block_callouts_default) {
+        _Block_assign_default(value, destptr);
+    }
+    else {
+        _Block_assign(value, destptr);
+    }
+}
+
+static __inline void _Block_callout_assign_weak(const void *ptr, void *dest) {
+    if (_Block_callouts_default) {
+        _Block_assign_weak_default(ptr, dest);
+    }
+    else {
+        _Block_assign_weak(ptr, dest);
+    }
+}
+
+// 之后不能再换掉 callout
+void _Block_seal_callouts(void) {
+    _Block_callouts_sealed = true;
+}
+
+
 /**************************************************************************
 GC support SPI functions - called from ObjC runtime and CoreFoundation
 ***************************************************************************/
@@ -250,8 +508,13 @@ void _Block_use_GC( void *(*alloc)(const unsigned long, const bool isOne, const
                     void (*gc_assign)(void *, void **),
                     void (*gc_assign_weak)(const void *, void *),
                     void (*gc_memmove)(void *, void *, unsigned long)) {
+    if (BLOCK_STATIC_CALLOUTS || _Block_callouts_sealed) return;
+    
     // GC 下下面这些函数都被替换了
+#if !BLOCK_STATIC_CALLOUTS
+    _Block_callouts_default = false;
     isGC = true;
+#endif
     _Block_allocator = alloc;
     _Block_deallocator = _Block_do_nothing;
     _Block_assign = gc_assign;
@@ -283,6 +546,11 @@ void _Block_use_GC5( void *(*alloc)(const unsigned long, const bool isOne, const
 // Blocks and Block_byrefs have their own special entry points.
 void _Block_use_RR( void (*retain)(const void *),
                     void (*release)(const void *)) {
+    if (BLOCK_STATIC_CALLOUTS || _Block_callouts_sealed) return;
+#if !BLOCK_STATIC_CALLOUTS
+    _Block_callouts_default = false;
+    _Block_rr_callouts = true;
+#endif
     _Block_retain_object = retain;
     _Block_release_object = release;
     _Block_destructInstance = dlsym(RTLD_DEFAULT, "objc_destructInstance");
@@ -291,11 +559,718 @@ void _Block_use_RR( void (*retain)(const void *),
 // Called from CF to indicate MRR. Newer version uses a versioned structure, so we can add more functions
 // without defining a new entry point.
 void _Block_use_RR2(const Block_callbacks_RR *callbacks) {
+    if (BLOCK_STATIC_CALLOUTS || _Block_callouts_sealed) return;
+#if !BLOCK_STATIC_CALLOUTS
+    _Block_callouts_default = false;
+    _Block_rr_callouts = true;
+#endif
     _Block_retain_object = callbacks->retain;
     _Block_release_object = callbacks->release;
     _Block_destructInstance = callbacks->destructInstance;
 }
 
+/****************************************************************************
+Slab allocator for heap blocks and byrefs
+ 
+ 堆上 block 和 byref 的 slab 分配器。
+ 绝大多数 block 都很小（Block_layout 本身 32 字节，再加上几个被引入的变量），
+ 并且拷贝到堆上后很快就会被 release，每次都走 malloc/free 代价太高。
+ 所以把小的 block 按大小分成若干个 size class，内存从 64KB 的 chunk 中切出来，chunk 不会还给系统。
+ 超过最大 size class 的仍然走 malloc。
+ 
+ block 和 byref 分别使用两个独立的 heap：byref 通常更小、活得更久、并且被多个 block 共享，
+ 放在一起的话 byref 会把 block 的 chunk 弄得很零碎。
+ 每个 heap 有自己的 size classes 和统计数据，见 _Block_get_heap_statistics()。
+ 
+ 每个线程在每个 heap 中有自己的 magazine（线程缓存），chunk 属于某一个 magazine：
+ 1. 分配时只从当前线程的 magazine 中拿，不需要加锁；
+ 2. 在分配它的线程上释放时，直接挂回这个 magazine 的空闲链表，也不需要原子操作；
+ 3. 在别的线程上释放时（比如生产者线程拷贝，消费者线程 release），
+    用 CAS 把它压到所属 magazine 的 remote 链表上，所属线程下次分配时一次性全部取走。
+ 线程退出时 magazine 不会被销毁，而是放到 abandoned 链表上，由之后新建的线程接手。
+ 
+ block 是从哪个 class 分配的，记在堆上 block 的 reserved 字段中（0 表示是 malloc 出来的），
+ 栈上的 block 的 reserved 都是 0，拷贝时会被覆盖。
+ byref 的 class 记在 Block_byref->flags 的 BLOCK_BYREF_SLAB_CLASS_MASK 位中。
+ 
+ 常驻的进程中可能同时有几千万个堆上的 block，调用它们时要读 descriptor 和被引入的变量，
+ TLB miss 很明显。_Block_use_huge_pages() 可以让 chunk 从 2MB 的大页 region 中切出来。
+ 
+ 多 socket 的机器上，chunk 默认放在切分它的线程所在的 NUMA node 上。一个线程拷贝、
+ 另一个 node 上的线程运行的 block 可以用 _Block_copy_to_node() 直接放到运行它的 node 上，
+ 这种拷贝从每个 node 各自的 node magazine 中分配，释放时和别的跨线程释放一样走 remote 链表。
+ 
+ 编译时定义 BLOCK_SLAB_ALLOCATOR=0 可以关掉 slab，全部退回 malloc/free。
+*****************************************************************************/
+
+#ifndef BLOCK_SLAB_ALLOCATOR
+#   if TARGET_OS_WIN32
+#       define BLOCK_SLAB_ALLOCATOR 0
+#   else
+#       define BLOCK_SLAB_ALLOCATOR 1
+#   endif
+#endif
+
+// biased refcount 靠 slab 的 magazine 来认 owner 线程，见下面的 Biased reference counting
+#ifndef BLOCK_BIASED_REFCOUNT
+#   define BLOCK_BIASED_REFCOUNT BLOCK_SLAB_ALLOCATOR
+#endif
+
+#define BLOCK_MAX_NUMA_NODES    64
+
+#if BLOCK_SLAB_ALLOCATOR
+
+#define BLOCK_SLAB_CHUNK_SIZE   (64 * 1024) // chunk 按自己的大小对齐，释放时由地址就能找到 chunk 头
+#define BLOCK_SLAB_CHUNK_HEADER 64
+#define BLOCK_SLAB_QUANTUM      16      // 与 malloc 的对齐保持一致，被引入的变量可能需要 16 字节对齐
+
+// 空闲的 slot 头部存放下一个空闲 slot 的地址
+struct Block_slab_free {
+    struct Block_slab_free *next;
+};
+
+struct Block_magazine_class {
+    struct Block_slab_free *freelist;           // 本线程释放的 slot，只有所属线程会碰
+    struct Block_slab_free * volatile remote;   // 其他线程释放的 slot，多个线程 push，所属线程整体取走
+    char *bump;                                 // 当前 chunk 中还没切出去的部分
+    char *end;
+};
+
+struct Block_magazine {
+    struct Block_heap *heap;
+    struct Block_magazine *next;        // abandoned 链表
+    struct Block_magazine *nextAll;     // heap 的所有 magazine，统计时用
+    int node;                           // 线程的 magazine 是 -1；node magazine 是它对应的 NUMA node
+    struct Block_merge *merges;         // 别的线程交给这个 magazine 的线程合并的 release，见 _Block_biased_release()
+                                        // 线程退出后是 BLOCK_MERGES_ABANDONED，直到有新线程接手
+    pthread_mutex_t lock;               // 只有 node magazine 用到，它不属于任何线程，分配时要加锁
+    // 只由所属线程修改，统计时直接读，不保证精确
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t remoteFrees;
+    uint64_t largeAllocations;
+    uint64_t chunks;
+    struct Block_magazine_class classes[];
+};
+
+struct Block_heap {
+    const uint16_t *sizes;              // 每个 class 的大小
+    const uint8_t *classForQuanta;      // (size + 15) / 16 -> class 的下标
+    unsigned classCount;
+    size_t maxSize;
+    pthread_key_t key;
+    struct Block_magazine *abandoned;   // 由 _Block_slab_lock 保护
+    struct Block_magazine *all;         // 由 _Block_slab_lock 保护
+    struct Block_magazine *nodes[BLOCK_MAX_NUMA_NODES]; // 指定了 NUMA node 的拷贝从这里分配
+};
+
+// 每个 chunk 开头的头部，chunk 中的 slot 都属于 owner 这个 magazine
+struct Block_slab_chunk {
+    struct Block_magazine *owner;
+};
+
+// block 的 size classes: Block_layout 是 32 字节（64 位下），每引入一个指针大小的变量加 8 字节，
+// 按 16 字节对齐后集中在 32 ~ 128 之间，所以这一段按 16 字节一档，之后放宽
+static const uint16_t _Block_block_sizes[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 256,
+};
+static const uint8_t _Block_block_class_for_quanta[] = {
+    0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 8, 8, 9, 9, 9, 9,
+};
+
+// byref 的 size classes: Block_byref 是 32 字节，__block int 这种是 48，
+// 带 copy/dispose helper 的 __block id 是 64，再大的很少见
+static const uint16_t _Block_byref_sizes[] = {
+    48, 64, 80, 96, 128,
+};
+static const uint8_t _Block_byref_class_for_quanta[] = {
+    0, 0, 0, 0, 1, 2, 3, 4, 4,
+};
+
+#define BLOCK_HEAP_INITIALIZER(_sizes, _classes) \
+    { .sizes = _sizes, .classForQuanta = _classes, \
+      .classCount = sizeof(_sizes) / sizeof(_sizes[0]), .maxSize = _sizes[sizeof(_sizes) / sizeof(_sizes[0]) - 1] }
+
+static struct Block_heap _Block_block_heap = BLOCK_HEAP_INITIALIZER(_Block_block_sizes, _Block_block_class_for_quanta);
+static struct Block_heap _Block_byref_heap = BLOCK_HEAP_INITIALIZER(_Block_byref_sizes, _Block_byref_class_for_quanta);
+
+static pthread_once_t _Block_magazine_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t _Block_slab_lock = PTHREAD_MUTEX_INITIALIZER; // 保护 abandoned 和 all 链表，以及大页 region
+
+// 大页模式，见 _Block_use_huge_pages()
+#define BLOCK_REGION_SIZE (2 * 1024 * 1024)
+static int _Block_huge_pages = BLOCK_HUGE_PAGES_NONE;
+// 每个 NUMA node 当前 region 中还没切出去的部分
+static char *_Block_region_cursor[BLOCK_MAX_NUMA_NODES];
+static char *_Block_region_end[BLOCK_MAX_NUMA_NODES];
+
+// 当前线程正在为哪个 NUMA node 拷贝（node + 1），0 表示没有指定，见 _Block_copy_to_node()。
+// 每次从 slab 分配都要看，用 __thread 而不是 pthread key
+static __thread int _Block_placement;
+
+#define BLOCK_MERGES_ABANDONED ((struct Block_merge *)1)
+
+#if BLOCK_BIASED_REFCOUNT
+static void _Block_biased_abandon(struct Block_magazine *magazine);
+#endif
+
+// 线程退出时调用，把 magazine 交出去，remote 链表还可以继续接收其他线程释放的 slot
+static void _Block_magazine_abandon(void *arg) {
+    struct Block_magazine *magazine = (struct Block_magazine *)arg;
+#if BLOCK_BIASED_REFCOUNT
+    if (magazine->heap == &_Block_block_heap) _Block_biased_abandon(magazine);
+#endif
+    pthread_mutex_lock(&_Block_slab_lock);
+    magazine->next = magazine->heap->abandoned;
+    magazine->heap->abandoned = magazine;
+    pthread_mutex_unlock(&_Block_slab_lock);
+}
+
+static void _Block_magazine_init(void) {
+    pthread_key_create(&_Block_block_heap.key, _Block_magazine_abandon);
+    pthread_key_create(&_Block_byref_heap.key, _Block_magazine_abandon);
+}
+
+// 新建一个 magazine，并记到 heap 的 all 链表中。调用者必须持有 _Block_slab_lock
+static struct Block_magazine *_Block_magazine_create(struct Block_heap *heap, int node) {
+    struct Block_magazine *magazine = calloc(1, sizeof(struct Block_magazine) + heap->classCount * sizeof(struct Block_magazine_class));
+    if (!magazine) return NULL;
+    magazine->heap = heap;
+    magazine->node = node;
+    pthread_mutex_init(&magazine->lock, NULL);
+    magazine->nextAll = heap->all;
+    heap->all = magazine;
+    return magazine;
+}
+
+// 取得当前线程在 heap 中的 magazine，第一次调用时接手一个 abandoned 的 magazine，或者新建一个
+// 返回 NULL 说明内存不足
+static struct Block_magazine *_Block_magazine_get(struct Block_heap *heap) {
+    pthread_once(&_Block_magazine_once, _Block_magazine_init);
+    struct Block_magazine *magazine = pthread_getspecific(heap->key);
+    if (magazine) return magazine;
+    
+    pthread_mutex_lock(&_Block_slab_lock);
+    magazine = heap->abandoned;
+    if (magazine) {
+        heap->abandoned = magazine->next;
+        // 之后别的线程的 release 又交给 owner 合并了
+        OSAtomicCompareAndSwapPtr(BLOCK_MERGES_ABANDONED, NULL, &magazine->merges);
+    }
+    else {
+        magazine = _Block_magazine_create(heap, -1);
+    }
+    pthread_mutex_unlock(&_Block_slab_lock);
+    if (!magazine) return NULL;
+    
+    magazine->next = NULL;
+    pthread_setspecific(heap->key, magazine);
+    return magazine;
+}
+
+// 开一个新的 chunk 给 magazine 的某个 class
+// 当前线程正在哪个 NUMA node 上运行，不支持 NUMA 的系统上总是 0
+static int _Block_current_node(void) {
+#if __linux__ && defined(SYS_getcpu)
+    unsigned cpu, node;
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0 && node < BLOCK_MAX_NUMA_NODES) return (int)node;
+#endif
+    return 0;
+}
+
+// 让 region 的物理内存优先从 node 上分配，必须在第一次访问之前调用
+static void _Block_region_bind(void *region, size_t size, int node) {
+#if __linux__ && defined(SYS_mbind)
+    unsigned long mask[BLOCK_MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, region, size, 1 /* MPOL_PREFERRED */, mask, BLOCK_MAX_NUMA_NODES + 1, 0);
+#else
+    (void)region; (void)size; (void)node;
+#endif
+}
+
+// 映射一块 2MB 对齐的 region，物理内存放在 node 上，打开了大页模式时尽量用大页来支持它
+// 调用者：_Block_chunk_alloc()
+static char *_Block_region_map(int node) {
+    void *region = MAP_FAILED;
+    
+    if (_Block_huge_pages == BLOCK_HUGE_PAGES_EXPLICIT) {
+        // 显式的大页，需要系统预留了大页（Linux 的 vm.nr_hugepages），失败时退回透明大页
+#if defined(MAP_HUGETLB)
+        region = mmap(NULL, BLOCK_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON|MAP_HUGETLB, -1, 0);
+#elif defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+        region = mmap(NULL, BLOCK_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#endif
+        if (region != MAP_FAILED) {
+            _Block_region_bind(region, BLOCK_REGION_SIZE, node);
+            return region;
+        }
+    }
+    
+    // 多映射一个 region 的大小，再把两头多余的部分还回去，得到 2MB 对齐的地址，这样内核才能用大页
+    char *raw = mmap(NULL, 2 * BLOCK_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + BLOCK_REGION_SIZE - 1) & ~(uintptr_t)(BLOCK_REGION_SIZE - 1));
+    if (aligned > raw) munmap(raw, aligned - raw);
+    if (aligned + BLOCK_REGION_SIZE < raw + 2 * BLOCK_REGION_SIZE) {
+        munmap(aligned + BLOCK_REGION_SIZE, raw + 2 * BLOCK_REGION_SIZE - (aligned + BLOCK_REGION_SIZE));
+    }
+#if defined(MADV_HUGEPAGE)
+    if (_Block_huge_pages != BLOCK_HUGE_PAGES_NONE) madvise(aligned, BLOCK_REGION_SIZE, MADV_HUGEPAGE);
+#endif
+    _Block_region_bind(aligned, BLOCK_REGION_SIZE, node);
+    return aligned;
+}
+
+// 取一个新的 chunk，node 为 -1 表示放在当前线程所在的 node 上。
+// 没有打开大页、也没有指定 node 时，chunk 直接向 malloc 要，物理内存在第一次访问时分配，
+// 而 chunk 只会被所属线程切分，所以自然就在这个线程所在的 node 上。
+// 否则 chunk 从每个 node 各自的 2MB region 中按顺序切出来，同一个 region 中的 block 共用一条 TLB 表项
+static void *_Block_chunk_alloc(int node) {
+    if (node < 0 && _Block_huge_pages == BLOCK_HUGE_PAGES_NONE) {
+        void *memory;
+        if (posix_memalign(&memory, BLOCK_SLAB_CHUNK_SIZE, BLOCK_SLAB_CHUNK_SIZE) != 0) return NULL;
+        return memory;
+    }
+    if (node < 0) node = _Block_current_node();
+    
+    pthread_mutex_lock(&_Block_slab_lock);
+    if (_Block_region_cursor[node] == _Block_region_end[node]) {
+        char *region = _Block_region_map(node);
+        if (!region) {
+            pthread_mutex_unlock(&_Block_slab_lock);
+            return NULL;
+        }
+        _Block_region_cursor[node] = region;
+        _Block_region_end[node] = region + BLOCK_REGION_SIZE;
+    }
+    void *chunk = _Block_region_cursor[node];
+    _Block_region_cursor[node] += BLOCK_SLAB_CHUNK_SIZE;
+    pthread_mutex_unlock(&_Block_slab_lock);
+    return chunk;
+}
+
+static bool _Block_magazine_refill(struct Block_magazine *magazine, struct Block_magazine_class *cls) {
+    void *memory = _Block_chunk_alloc(magazine->node);
+    if (!memory) return false;
+    
+    struct Block_slab_chunk *chunk = (struct Block_slab_chunk *)memory;
+    chunk->owner = magazine;
+    cls->bump = (char *)chunk + BLOCK_SLAB_CHUNK_HEADER;
+    cls->end = (char *)chunk + BLOCK_SLAB_CHUNK_SIZE;
+    magazine->chunks++;
+    return true;
+}
+
+// 取得 heap 中 node 对应的 node magazine，第一次用到时创建
+static struct Block_magazine *_Block_node_magazine_get(struct Block_heap *heap, int node) {
+    struct Block_magazine *magazine = heap->nodes[node];
+    if (magazine) return magazine;
+    
+    pthread_mutex_lock(&_Block_slab_lock);
+    magazine = heap->nodes[node];
+    if (!magazine) {
+        magazine = _Block_magazine_create(heap, node);
+        __sync_synchronize();
+        heap->nodes[node] = magazine;
+    }
+    pthread_mutex_unlock(&_Block_slab_lock);
+    return magazine;
+}
+
+// 从 magazine 中分配 size 大小的内存，size 不能超过 heap 最大的 size class
+static void *_Block_magazine_alloc(struct Block_magazine *magazine, size_t size, int32_t *tag) {
+    struct Block_heap *heap = magazine->heap;
+    unsigned index = heap->classForQuanta[(size + BLOCK_SLAB_QUANTUM - 1) / BLOCK_SLAB_QUANTUM];
+    struct Block_magazine_class *cls = &magazine->classes[index];
+    struct Block_slab_free *slot = cls->freelist;
+    
+    if (!slot && cls->remote) {
+        // 本线程的空闲链表空了，把其他线程还回来的一次性全部取走
+        slot = __sync_lock_test_and_set(&cls->remote, NULL);
+    }
+    if (slot) { // 优先复用被释放的 slot
+        cls->freelist = slot->next;
+        magazine->allocations++;
+        *tag = (int32_t)index + 1;
+        return slot;
+    }
+    
+    size_t slotSize = heap->sizes[index];
+    if (cls->bump + slotSize > cls->end && !_Block_magazine_refill(magazine, cls)) {
+        return NULL;
+    }
+    void *result = cls->bump;
+    cls->bump += slotSize;
+    magazine->allocations++;
+    *tag = (int32_t)index + 1;
+    return result;
+}
+
+// 从 heap 中分配 size 大小的内存，*tag 中返回 class 下标 + 1，如果是 malloc 出来的，则 *tag 为 0
+// 当前线程正在为某个 NUMA node 拷贝时，从这个 node 的 node magazine 中分配
+// 调用者：_Block_heap_alloc()
+static void *_Block_slab_alloc(struct Block_heap *heap, size_t size, int32_t *tag) {
+    struct Block_magazine *magazine = _Block_magazine_get(heap);
+    if (!magazine || size > heap->maxSize) {
+        if (magazine) magazine->largeAllocations++;
+        *tag = 0;
+        return malloc(size);
+    }
+    
+    if (_Block_placement) {
+        struct Block_magazine *nodeMagazine = _Block_node_magazine_get(heap, _Block_placement - 1);
+        if (nodeMagazine) {
+            pthread_mutex_lock(&nodeMagazine->lock);
+            void *result = _Block_magazine_alloc(nodeMagazine, size, tag);
+            pthread_mutex_unlock(&nodeMagazine->lock);
+            return result;
+        }
+    }
+    return _Block_magazine_alloc(magazine, size, tag);
+}
+
+// 释放 _Block_slab_alloc() 分配的内存，tag 就是分配时返回的 tag
+// 调用者：_Block_heap_free()
+static void _Block_slab_free(struct Block_heap *heap, void *ptr, int32_t tag) {
+    if (tag == 0) {
+        free(ptr);
+        return;
+    }
+    
+    struct Block_slab_chunk *chunk = (struct Block_slab_chunk *)((uintptr_t)ptr & ~(uintptr_t)(BLOCK_SLAB_CHUNK_SIZE - 1));
+    struct Block_magazine_class *cls = &chunk->owner->classes[tag - 1];
+    struct Block_slab_free *slot = (struct Block_slab_free *)ptr;
+    struct Block_magazine *current = _Block_magazine_get(heap);
+    
+    if (chunk->owner == current) {
+        // 在分配它的线程上释放，直接放回本线程的空闲链表
+        slot->next = cls->freelist;
+        cls->freelist = slot;
+        current->frees++;
+        return;
+    }
+    
+    // 别的线程分配的，还给它
+    if (current) {
+        current->frees++;
+        current->remoteFrees++;
+    }
+    while (1) {
+        struct Block_slab_free *head = cls->remote;
+        slot->next = head;
+        if (OSAtomicCompareAndSwapPtr(head, slot, &cls->remote)) return;
+    }
+}
+
+// 从 BLOCK_HEAP_BLOCKS 或 BLOCK_HEAP_BYREFS 中分配
+static void *_Block_heap_alloc(int kind, size_t size, int32_t *tag) {
+    return _Block_slab_alloc(kind == BLOCK_HEAP_BYREFS ? &_Block_byref_heap : &_Block_block_heap, size, tag);
+}
+
+static void _Block_heap_free(int kind, void *ptr, int32_t tag) {
+    _Block_slab_free(kind == BLOCK_HEAP_BYREFS ? &_Block_byref_heap : &_Block_block_heap, ptr, tag);
+}
+
+#if BLOCK_BIASED_REFCOUNT
+// 当前线程在 block heap 中的 magazine，还没有的话返回 NULL
+static struct Block_magazine *_Block_current_block_magazine(void) {
+    return (struct Block_magazine *)pthread_getspecific(_Block_block_heap.key);
+}
+#endif
+
+// 从 slab 中分配的内存所在 chunk 属于哪个 magazine
+static struct Block_magazine *_Block_chunk_owner(const void *ptr) {
+    return ((struct Block_slab_chunk *)((uintptr_t)ptr & ~(uintptr_t)(BLOCK_SLAB_CHUNK_SIZE - 1)))->owner;
+}
+
+// 一次释放 n 块 _Block_heap_alloc() 分配的内存。
+// 连续几块属于同一个 magazine 的同一个 class 时，先串成一条链：
+// 属于当前线程的一次挂到空闲链表上，属于别的线程的用一次 CAS 还给它
+// 调用者：_Block_release_many()
+static void _Block_heap_free_many(int kind, void **ptrs, int32_t *tags, size_t n) {
+    struct Block_heap *heap = kind == BLOCK_HEAP_BYREFS ? &_Block_byref_heap : &_Block_block_heap;
+    struct Block_magazine *current = _Block_magazine_get(heap);
+    size_t i = 0;
+    while (i < n) {
+        if (tags[i] == 0) {
+            free(ptrs[i++]);
+            continue;
+        }
+        int32_t tag = tags[i];
+        struct Block_magazine *owner = _Block_chunk_owner(ptrs[i]);
+        struct Block_slab_free *first = (struct Block_slab_free *)ptrs[i];
+        struct Block_slab_free *last = first;
+        size_t j = i + 1;
+        while (j < n && tags[j] == tag && _Block_chunk_owner(ptrs[j]) == owner) {
+            last->next = (struct Block_slab_free *)ptrs[j];
+            last = last->next;
+            j++;
+        }
+        
+        struct Block_magazine_class *cls = &owner->classes[tag - 1];
+        if (owner == current) {
+            last->next = cls->freelist;
+            cls->freelist = first;
+            current->frees += j - i;
+        }
+        else {
+            if (current) {
+                current->frees += j - i;
+                current->remoteFrees += j - i;
+            }
+            while (1) {
+                struct Block_slab_free *head = cls->remote;
+                last->next = head;
+                if (OSAtomicCompareAndSwapPtr(head, first, &cls->remote)) break;
+            }
+        }
+        i = j;
+    }
+}
+
+// 统计 heap 中所有 magazine 的数据
+// 调用者：_Block_get_heap_statistics()
+static void _Block_slab_statistics(struct Block_heap *heap, Block_heap_statistics *stats) {
+    pthread_mutex_lock(&_Block_slab_lock);
+    for (struct Block_magazine *magazine = heap->all; magazine; magazine = magazine->nextAll) {
+        stats->allocations += magazine->allocations;
+        stats->frees += magazine->frees;
+        stats->remoteFrees += magazine->remoteFrees;
+        stats->largeAllocations += magazine->largeAllocations;
+        stats->chunks += magazine->chunks;
+    }
+    pthread_mutex_unlock(&_Block_slab_lock);
+}
+
+// 设置大页模式，之后新开的 chunk 都从大页 region 中分配，已经分配的 chunk 不受影响
+void _Block_use_huge_pages(int mode) {
+    _Block_huge_pages = mode;
+}
+
+// 之后当前线程上的分配都放到 node 上，node 为 -1 表示取消。返回原来的设置
+// 调用者：_Block_copy_to_node()
+static int _Block_set_placement_node(int node) {
+    int previous = _Block_placement - 1;
+    _Block_placement = node + 1;
+    return previous;
+}
+
+int _Block_current_numa_node(void) {
+    return _Block_current_node();
+}
+
+#else
+
+void _Block_use_huge_pages(int mode __unused) {
+}
+
+static int _Block_set_placement_node(int node __unused) {
+    return -1;
+}
+
+int _Block_current_numa_node(void) {
+    return 0;
+}
+
+static void *_Block_heap_alloc(int kind __unused, size_t size, int32_t *tag) {
+    *tag = 0;
+    return malloc(size);
+}
+
+static void _Block_heap_free(int kind __unused, void *ptr, int32_t tag __unused) {
+    free(ptr);
+}
+
+static void _Block_heap_free_many(int kind __unused, void **ptrs, int32_t *tags __unused, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        free(ptrs[i]);
+    }
+}
+
+#endif // BLOCK_SLAB_ALLOCATOR
+
+
+/****************************************************************************
+Pluggable allocator
+ 
+ 进程可以用 _Block_use_allocator() 装上自己的分配器（比如 jemalloc 的 arena、mimalloc 的 heap），
+ 之后非 GC 下堆上的 block 和 byref 都从它分配，不再使用 slab。
+ 它分配的内存用 BLOCK_TAG_CUSTOM 作为 tag，释放时交还给它的 free 回调。
+*****************************************************************************/
+
+#define BLOCK_TAG_CUSTOM 0xf    // byref 的 tag 只有 4 位，slab 的 class 用不到这么多
+#define BLOCK_RESERVED_TAG_MASK 0xffff  // 堆上 block 的 reserved 中低 16 位是 tag，高位是 biased refcount 的 local count
+
+static Block_callbacks_allocator _Block_custom_allocator;
+static bool _Block_has_custom_allocator = false;
+
+// 装上自定义的分配器，必须在第一次拷贝 block 之前调用
+void _Block_use_allocator(const Block_callbacks_allocator *callbacks) {
+    memset(&_Block_custom_allocator, 0, sizeof(_Block_custom_allocator));
+    size_t size = callbacks->size < sizeof(_Block_custom_allocator) ? callbacks->size : sizeof(_Block_custom_allocator);
+    memcpy(&_Block_custom_allocator, callbacks, size);
+    _Block_custom_allocator.size = sizeof(_Block_custom_allocator);
+    _Block_has_custom_allocator = true;
+}
+
+// 分配非 GC 下堆上的 block / byref，*tag 中返回释放时需要的信息
+// 调用者：_Block_copy_internal() / _Block_copy_coallocated() / _Block_byref_assign_copy()
+static void *_Block_alloc_memory(int kind, size_t size, int32_t *tag) {
+    if (_Block_has_custom_allocator) {
+        *tag = BLOCK_TAG_CUSTOM;
+        return _Block_custom_allocator.alloc(size, kind, _Block_custom_allocator.context);
+    }
+    return _Block_heap_alloc(kind, size, tag);
+}
+
+// 释放 _Block_alloc_memory() 分配的内存，size 是分配时的大小
+// 调用者：_Block_free_block() / _Block_free_byref() / _Block_coalloc_release()
+static void _Block_free_memory(int kind, void *ptr, size_t size, int32_t tag) {
+    if (tag == BLOCK_TAG_CUSTOM) {
+        if (_Block_custom_allocator.free_sized) {
+            _Block_custom_allocator.free_sized(ptr, size, kind, _Block_custom_allocator.context);
+        }
+        else {
+            _Block_custom_allocator.free(ptr, kind, _Block_custom_allocator.context);
+        }
+        return;
+    }
+    _Block_heap_free(kind, ptr, tag);
+}
+
+
+/****************************************************************************
+Co-allocation of __block variables with the block
+ 
+ 栈上的 block 第一次被拷贝时，它引用的 __block 变量通常也是第一次被拷贝到堆上，
+ 原来要分配 1 + n 次内存。打开 co-allocation 后（见 _Block_use_byref_coallocation()），
+ block 和这些 byref 放在同一块内存中：
+ 
+   | Block_coalloc_header | Block_coalloc_slot | block | Block_coalloc_slot | byref | Block_coalloc_slot | byref | ...
+ 
+ byref 可能被别的 block 共享，比当前 block 活得更久，所以 header 中记录还活着的子对象个数，
+ block 和 byref 各自照常做引用计数，计数减到 0 时只是让 live 减 1，live 减到 0 才真正释放整块内存。
+ 
+ _Block_copy_many() 用同样的布局把一组栈上的 block 放在一块内存中，每个 block 前面都有一个 slot。
+ 
+ 要在调用 copy helper 之前就知道要拷贝哪些 byref，所以只有带扩展布局的 block 才会这样做。
+ copy helper 调用 _Block_byref_assign_copy() 时，从当前线程的 Block_coalloc_context 中取出预留好的空间。
+*****************************************************************************/
+
+#ifndef BLOCK_COALLOCATION
+#   if TARGET_OS_WIN32
+#       define BLOCK_COALLOCATION 0
+#   else
+#       define BLOCK_COALLOCATION 1
+#   endif
+#endif
+
+#define BLOCK_COALLOC_MAX_BYREFS 4
+#define BLOCK_COALLOC_ALIGN(_x) (((_x) + 15) & ~(size_t)15)
+
+struct Block_coalloc_header {
+    volatile int32_t live;  // 还活着的子对象个数：放在这块内存中的 block 和 byref
+    int32_t tag;            // 整块内存是从 block heap 的哪个 size class 分配的
+    uint64_t size;          // 整块内存的大小，同时保证后面的 block 16 字节对齐
+};
+
+// 每个 block 和 byref 前面的头部，用来找到整块内存的 header
+struct Block_coalloc_slot {
+    struct Block_coalloc_header *header;
+    uint64_t pad;
+};
+
+static struct Block_coalloc_header *_Block_coalloc_header_of_block(struct Block_layout *aBlock) {
+    return ((struct Block_coalloc_slot *)aBlock - 1)->header;
+}
+
+static struct Block_coalloc_header *_Block_coalloc_header_of_byref(struct Block_byref *byref) {
+    return ((struct Block_coalloc_slot *)byref - 1)->header;
+}
+
+// 一个子对象死了，如果它是最后一个，释放整块内存
+static void _Block_coalloc_release(struct Block_coalloc_header *header) {
+    if (__sync_sub_and_fetch(&header->live, 1) == 0) {
+        _Block_free_memory(BLOCK_HEAP_BLOCKS, header, (size_t)header->size, header->tag);
+    }
+}
+
+// 释放一个非 GC 下被拷贝到堆上的 block
+// 调用者：_Block_release()
+static void _Block_free_block(struct Block_layout *aBlock) {
+    if (aBlock->flags & BLOCK_COALLOCATED) {
+        _Block_coalloc_release(_Block_coalloc_header_of_block(aBlock));
+        return;
+    }
+    _Block_free_memory(BLOCK_HEAP_BLOCKS, aBlock, aBlock->descriptor->size, aBlock->reserved & BLOCK_RESERVED_TAG_MASK);
+}
+
+// 释放一个非 GC 下被拷贝到堆上的 byref
+// 调用者：_Block_byref_release()
+static void _Block_free_byref(struct Block_byref *byref) {
+    if (byref->flags & BLOCK_BYREF_COALLOCATED) {
+        _Block_coalloc_release(_Block_coalloc_header_of_byref(byref));
+        return;
+    }
+    _Block_free_memory(BLOCK_HEAP_BYREFS, byref, byref->size, (byref->flags & BLOCK_BYREF_SLAB_CLASS_MASK) >> BLOCK_BYREF_SLAB_CLASS_SHIFT);
+}
+
+#if BLOCK_COALLOCATION
+
+static bool _Block_coallocate_byrefs = false;
+
+// 一次拷贝中预留给 byref 的空间。copy helper 中可能又拷贝了别的 block，所以是一个栈
+struct Block_coalloc_context {
+    struct Block_coalloc_context *previous;
+    unsigned count;
+    struct Block_byref *sources[BLOCK_COALLOC_MAX_BYREFS];  // 栈上的 byref
+    struct Block_byref *copies[BLOCK_COALLOC_MAX_BYREFS];   // 预留给它的空间，用掉以后置为 NULL
+    struct Block_coalloc_header *header;
+};
+
+// 当前线程上最里层的 context
+static __thread struct Block_coalloc_context *_Block_coalloc_current;
+
+// 和 Block_worklist 一样，copy helper 抛出 C++ 异常时也要恢复外面那个 context
+static void _Block_coalloc_leave(struct Block_coalloc_context **context) {
+    _Block_coalloc_current = (*context)->previous;
+}
+
+// 如果正在拷贝的 block 为 src 预留了空间，就取走它，否则返回 NULL
+// 调用者：_Block_byref_assign_copy()
+static struct Block_byref *_Block_coalloc_take(struct Block_byref *src) {
+    if (!_Block_coallocate_byrefs) return NULL;
+    struct Block_coalloc_context *context = _Block_coalloc_current;
+    if (!context) return NULL;
+    
+    for (unsigned i = 0; i < context->count; i++) {
+        if (context->sources[i] == src && context->copies[i]) {
+            struct Block_byref *copy = context->copies[i];
+            context->copies[i] = NULL;
+            return copy;
+        }
+    }
+    return NULL;
+}
+
+#else
+
+static struct Block_byref *_Block_coalloc_take(struct Block_byref *src __unused) {
+    return NULL;
+}
+
+#endif // BLOCK_COALLOCATION
+
+// 打开或关闭 block 和 __block 变量的 co-allocation，见 Block_coalloc_header
+void _Block_use_byref_coallocation(bool enabled) {
+#if BLOCK_COALLOCATION
+    _Block_coallocate_byrefs = enabled;
+#else
+    (void)enabled;
+#endif
+}
+
 /****************************************************************************
 Accessors for block descriptor fields
 *****************************************************************************/
@@ -307,7 +1282,7 @@ static struct Block_descriptor_1 * _Block_descriptor_1(struct Block_layout *aBlo
 #endif
 
 // 取得 block 中的 Block_descriptor_2，它藏在 descriptor 列表中
-// 调用者：_Block_call_copy_helper() / _Block_call_dispose_helper
+// 调用者：_Block_call_copy_helper() / _Block_call_dispose_helper / _Block_plan_create()
 static struct Block_descriptor_2 * _Block_descriptor_2(struct Block_layout *aBlock)
 {
     // Block_descriptor_2 中存的是 copy/dispose 方法，如果没有指定有 copy / dispose 方法，则返回 NULL
@@ -322,7 +1297,7 @@ static struct Block_descriptor_2 * _Block_descriptor_2(struct Block_layout *aBlo
 }
 
 // 取得 block 中的 Block_descriptor_3，它藏在 descriptor 列表中
-// 调用者：_Block_extended_layout() / _Block_layout() / _Block_signature()
+// 调用者：_Block_extended_layout() / _Block_layout() / _Block_signature() / _Block_plan_create()
 static struct Block_descriptor_3 * _Block_descriptor_3(struct Block_layout *aBlock)
 {
     // Block_descriptor_3 中存的是 block 的签名，如果没有指定有签名，则直接返回 NULL
@@ -338,61 +1313,920 @@ static struct Block_descriptor_3 * _Block_descriptor_3(struct Block_layout *aBlo
     if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
         desc += sizeof(struct Block_descriptor_2);
     }
-    return (struct Block_descriptor_3 *)desc;
+    return (struct Block_descriptor_3 *)desc;
+}
+
+// 判断 block 是否有扩展布局（extended layout），扩展布局存在 Block_descriptor_3 中
+// 调用者：_Block_copy_internal()
+static __inline bool _Block_has_layout(struct Block_layout *aBlock) {
+    // 如果没有指定有签名，即没有 Block_descriptor_3，就返回 false
+    if (! (aBlock->flags & BLOCK_HAS_SIGNATURE)) return false;
+    
+    // 先取得 Block_descriptor_1 的地址
+    uint8_t *desc = (uint8_t *)aBlock->descriptor;
+    
+    // 先偏移 Block_descriptor_1 的大小
+    desc += sizeof(struct Block_descriptor_1);
+    
+    // 如果还有 Block_descriptor_2，就再偏移 Block_descriptor_2 的大小，得到的就是 Block_descriptor_3 的地址
+    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
+        desc += sizeof(struct Block_descriptor_2);
+    }
+    
+    // 看 Block_descriptor_3 中的 layout 是否非空
+    return ((struct Block_descriptor_3 *)desc)->layout != NULL;
+}    
+
+#if BLOCK_COALLOCATION
+// 按扩展布局找出 block 中所有 byref 指针的位置（相对于 block 起始地址的偏移），最多找 max 个
+// 返回找到的个数，布局中有不认识的操作符时返回 -1
+// 调用者：_Block_copy_coallocated()
+static int _Block_layout_byref_offsets(struct Block_layout *aBlock, size_t *offsets, int max) {
+    const char *layout = _Block_extended_layout(aBlock);
+    if (!layout) return -1;
+    
+    // 布局描述的是 Block_layout 后面被引入的变量
+    size_t offset = sizeof(struct Block_layout);
+    int count = 0;
+    
+    if ((uintptr_t)layout < 0x1000) {
+        // 紧凑编码 0xXYZ：X 个强指针，然后是 Y 个 byref 指针，然后是 Z 个弱指针
+        uintptr_t compact = (uintptr_t)layout;
+        offset += ((compact >> 8) & 0xf) * sizeof(void *);
+        for (unsigned i = 0; i < ((compact >> 4) & 0xf) && count < max; i++) {
+            offsets[count++] = offset;
+            offset += sizeof(void *);
+        }
+        return count;
+    }
+    
+    // 字节串编码，每个字节是 0xPN，N 是个数减 1
+    for (const unsigned char *cursor = (const unsigned char *)layout; *cursor; cursor++) {
+        unsigned op = *cursor >> 4;
+        unsigned n = (*cursor & 0xf) + 1;
+        switch (op) {
+          case BLOCK_LAYOUT_NON_OBJECT_BYTES:
+            offset += n;
+            break;
+          case BLOCK_LAYOUT_BYREF:
+            for (unsigned i = 0; i < n; i++) {
+                if (count < max) offsets[count++] = offset;
+                offset += sizeof(void *);
+            }
+            break;
+          case BLOCK_LAYOUT_NON_OBJECT_WORDS:
+          case BLOCK_LAYOUT_STRONG:
+          case BLOCK_LAYOUT_WEAK:
+          case BLOCK_LAYOUT_UNRETAINED:
+          case BLOCK_LAYOUT_UNKNOWN_WORDS_7:
+          case BLOCK_LAYOUT_UNKNOWN_WORDS_8:
+          case BLOCK_LAYOUT_UNKNOWN_WORDS_9:
+          case BLOCK_LAYOUT_UNKNOWN_WORDS_A:
+            offset += n * sizeof(void *);
+            break;
+          default:
+            return -1;
+        }
+    }
+    return count;
+}
+#endif
+
+/****************************************************************************
+ Layout-driven copy and dispose
+ 
+ 有扩展布局的 block，布局已经说明了每个被引入的变量是强引用、byref、弱引用还是非对象。
+ copy helper 做的事情就是对其中的强引用和 byref 逐个调用 _Block_object_assign()，
+ 所以 runtime 可以直接按布局在一个循环中做 retain 和 byref 的拷贝，不用间接调用 helper，
+ 也不用每个字段都经过一次 _Block_object_assign() 中的 switch。dispose 同理。
+ 
+ 有 C++ 对象（BLOCK_HAS_CTOR）、弱引用（需要 objc_copyWeak）或者不认识的操作符时，还是调用 helper。
+ 没有装 RR callout 时引入了不是 block 的对象也要调用 helper：ARC 的 helper 不经过 callout，直接 objc_retain/objc_release。
+ GC 下一直调用 helper。编译时定义 BLOCK_LAYOUT_INTERPRETER=0 可以关掉。
+*****************************************************************************/
+
+#ifndef BLOCK_LAYOUT_INTERPRETER
+#define BLOCK_LAYOUT_INTERPRETER 1
+#endif
+
+#if BLOCK_LAYOUT_INTERPRETER
+
+#define BLOCK_MAX_CAPTURES 32
+
+enum {
+    BLOCK_CAPTURE_STRONG,   // 对象或者 block
+    BLOCK_CAPTURE_BYREF,    // __block 变量
+};
+
+// 一个需要 runtime 拷贝/销毁的被引入变量
+struct Block_capture {
+    uint16_t offset;    // 相对于 block 起始地址的偏移
+    uint16_t kind;
+};
+
+static void *_Block_copy_internal(const void *arg, const bool wantsOne, const bool nested);
+static void _Block_byref_assign_copy(void *dest, const void *arg, const int flags);
+static void _Block_byref_release(const void *arg);
+
+// 把扩展布局翻译成需要拷贝/销毁的字段，最多 max 个
+// 返回字段个数，返回 -1 表示 runtime 不能代替 helper
+static int _Block_layout_captures(struct Block_layout *aBlock, struct Block_capture *captures, int max) {
+    if ((aBlock->flags & (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_CTOR|BLOCK_HAS_EXTENDED_LAYOUT)) != (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_EXTENDED_LAYOUT)) {
+        return -1;
+    }
+    const char *layout = _Block_extended_layout(aBlock);
+    if (!layout) return -1;
+    
+    size_t offset = sizeof(struct Block_layout);
+    int count = 0;
+    
+    if ((uintptr_t)layout < 0x1000) {
+        // 紧凑编码 0xXYZ：X 个强指针，然后是 Y 个 byref 指针，然后是 Z 个弱指针
+        uintptr_t compact = (uintptr_t)layout;
+        unsigned strong = (compact >> 8) & 0xf, byref = (compact >> 4) & 0xf, weak = compact & 0xf;
+        if (weak || (int)(strong + byref) > max) return -1;
+        for (unsigned i = 0; i < strong; i++, offset += sizeof(void *)) {
+            captures[count].offset = (uint16_t)offset;
+            captures[count++].kind = BLOCK_CAPTURE_STRONG;
+        }
+        for (unsigned i = 0; i < byref; i++, offset += sizeof(void *)) {
+            captures[count].offset = (uint16_t)offset;
+            captures[count++].kind = BLOCK_CAPTURE_BYREF;
+        }
+        return count;
+    }
+    
+    // 字节串编码，每个字节是 0xPN，N 是个数减 1
+    for (const unsigned char *cursor = (const unsigned char *)layout; *cursor; cursor++) {
+        unsigned op = *cursor >> 4;
+        unsigned n = (*cursor & 0xf) + 1;
+        switch (op) {
+          case BLOCK_LAYOUT_NON_OBJECT_BYTES:
+            offset += n;
+            break;
+          case BLOCK_LAYOUT_NON_OBJECT_WORDS:
+          case BLOCK_LAYOUT_UNRETAINED:
+            offset += n * sizeof(void *);
+            break;
+          case BLOCK_LAYOUT_STRONG:
+          case BLOCK_LAYOUT_BYREF:
+            if (count + (int)n > max || offset + n * sizeof(void *) > UINT16_MAX) return -1;
+            for (unsigned i = 0; i < n; i++, offset += sizeof(void *)) {
+                captures[count].offset = (uint16_t)offset;
+                captures[count++].kind = op == BLOCK_LAYOUT_STRONG ? BLOCK_CAPTURE_STRONG : BLOCK_CAPTURE_BYREF;
+            }
+            break;
+          default:
+            return -1; // 弱引用，或者不认识的操作符
+        }
+    }
+    return count;
+}
+
+// 强引用的字段也可能是 block，这时 helper 用的是 BLOCK_FIELD_IS_BLOCK，要拷贝而不是 retain
+// nil 和 tagged pointer 不能解引用，它们肯定不是 block
+static __inline bool _Block_capture_is_block(const void *object) {
+    if (!object || ((uintptr_t)object & 1) || (intptr_t)object < 0) return false;
+    void *isa = *(void **)object;
+    return isa == _NSConcreteStackBlock || isa == _NSConcreteMallocBlock || isa == _NSConcreteGlobalBlock
+        || isa == _NSConcreteAutoBlock || isa == _NSConcreteFinalizingBlock;
+}
+
+// 强引用的字段中有不是 block 的对象时，只有装了 RR callout 才能代替 helper：
+// MRR 的 helper 经过 _Block_object_assign() 调用 _Block_retain_object，和下面一样；
+// ARC 的 helper 直接调用 objc_retain/objc_release，没装 callout 时 _Block_callout_retain_object() 却什么也不干
+static bool _Block_captures_need_helper(struct Block_layout *aBlock, const struct Block_capture *captures, int count) {
+    if (_Block_rr_callouts) return false;
+    for (int i = 0; i < count; i++) {
+        if (captures[i].kind != BLOCK_CAPTURE_STRONG) continue;
+        void *object = *(void **)((char *)aBlock + captures[i].offset);
+        if (object && !_Block_capture_is_block(object)) return true;
+    }
+    return false;
+}
+
+// 代替 copy helper：memmove 之后 result 中的字段还是原来的值，逐个 retain / 拷贝
+static void _Block_copy_captures(struct Block_layout *result, const struct Block_capture *captures, int count) {
+    for (int i = 0; i < count; i++) {
+        void **field = (void **)((char *)result + captures[i].offset);
+        void *object = *field;
+        if (captures[i].kind == BLOCK_CAPTURE_BYREF) {
+            _Block_byref_assign_copy(field, object, BLOCK_FIELD_IS_BYREF);
+        }
+        else if (_Block_capture_is_block(object)) {
+            *field = _Block_copy_internal(object, false, true);
+        }
+        else {
+            _Block_callout_retain_object(object);
+        }
+    }
+}
+
+// 代替 dispose helper
+static void _Block_dispose_captures(struct Block_layout *aBlock, const struct Block_capture *captures, int count) {
+    for (int i = 0; i < count; i++) {
+        void *object = *(void **)((char *)aBlock + captures[i].offset);
+        if (captures[i].kind == BLOCK_CAPTURE_BYREF) {
+            _Block_byref_release(object);
+        }
+        else if (_Block_capture_is_block(object)) {
+            _Block_release(object);
+        }
+        else {
+            _Block_callout_release_object(object);
+        }
+    }
+}
+
+#endif // BLOCK_LAYOUT_INTERPRETER
+
+/****************************************************************************
+ Compiled copy plans
+
+ 同一个 block 字面量拷贝出来的 block 共用一个 descriptor。第一次遇到某个 descriptor 时，
+ 把 copy/dispose 要用到的东西整理成一个 Block_plan：helper、签名和布局指针，以及按扩展布局翻译好的
+ 强引用和 byref 字段。之后这个 descriptor 的 block 拷贝和释放时直接用它，不用每次都解析扩展布局，
+ 也不用在 _Block_descriptor_2() / _Block_descriptor_3() 中按 flags 算偏移。
+
+ plan 放在以 descriptor 地址为 key 的开放寻址哈希表中，只插入不删除，查找不加锁：
+ 空槽用 CAS 填入，抢输了就接着往后找。表满了（探测太多次）就不缓存，按原来的方式处理。
+ descriptor 是编译器生成的常量，flags 中编译器设置的位也是 key 的一部分，plan 建好后不会再变，也不会释放。
+
+ descriptor 所在的 image 被 dlclose 以后，同一个地址可能被别的 image 的 descriptor 用上，不能再用旧的 plan：
+ 1. Apple 平台上用 _dyld_register_func_for_remove_image() 在卸载 image 时清空哈希表。
+    旧的 plan 不释放，别的线程可能正拿着它（这时它拷贝的 block 属于别的 image）；卸载 image 很少见，每次最多留下一张表。
+ 2. Linux 上没有卸载的通知，只缓存主程序中的 descriptor，主程序不会被卸载。动态库中的 block 按原来的方式处理。
+ 其他平台上没有打开。编译时定义 BLOCK_COPY_PLANS=0 可以关掉。
+*****************************************************************************/
+
+#ifndef BLOCK_COPY_PLANS
+#   if __APPLE__ || __linux__
+#       define BLOCK_COPY_PLANS 1
+#   else
+#       define BLOCK_COPY_PLANS 0
+#   endif
+#endif
+
+#if BLOCK_COPY_PLANS
+
+// flags 中由编译器设置、决定 descriptor 怎么解读的位
+#define BLOCK_PLAN_FLAGS (BLOCK_HAS_COPY_DISPOSE|BLOCK_HAS_CTOR|BLOCK_USE_STRET|BLOCK_HAS_SIGNATURE|BLOCK_HAS_EXTENDED_LAYOUT)
+#define BLOCK_PLAN_TABLE_SIZE 1024  // 必须是 2 的幂
+#define BLOCK_PLAN_MAX_PROBES 16
+
+struct Block_plan {
+    struct Block_descriptor_1 *descriptor;
+    int32_t flags;                              // aBlock->flags & BLOCK_PLAN_FLAGS
+    int32_t count;                              // captures 的个数，-1 表示要调用 helper
+    void (*copy)(void *dst, const void *src);   // 没有 Block_descriptor_2 时为 NULL
+    void (*dispose)(const void *);
+    const char *signature;                      // 没有 Block_descriptor_3 时为 NULL
+    const char *layout;                         // GC layout 或者扩展布局，看 flags
+#if BLOCK_LAYOUT_INTERPRETER
+    struct Block_capture captures[];
+#endif
+};
+
+static struct Block_plan * volatile _Block_plans[BLOCK_PLAN_TABLE_SIZE];
+static pthread_once_t _Block_plans_once = PTHREAD_ONCE_INIT;
+
+#if __APPLE__
+
+static void _Block_plans_image_removed(const struct mach_header *mh __unused, intptr_t slide __unused) {
+    for (size_t i = 0; i < BLOCK_PLAN_TABLE_SIZE; i++) {
+        _Block_plans[i] = NULL;
+    }
+}
+
+static void _Block_plans_init(void) {
+    _dyld_register_func_for_remove_image(_Block_plans_image_removed);
+}
+
+static __inline bool _Block_plan_cacheable(struct Block_descriptor_1 *descriptor __unused) {
+    return true;
+}
+
+#else
+
+// 主程序的 PT_LOAD 段覆盖的地址范围
+static uintptr_t _Block_main_image_start, _Block_main_image_end;
+
+static int _Block_find_main_image(struct dl_phdr_info *info, size_t size __unused, void *context __unused) {
+    // 第一个是主程序
+    uintptr_t start = UINTPTR_MAX, end = 0;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD) continue;
+        uintptr_t segment = info->dlpi_addr + phdr->p_vaddr;
+        if (segment < start) start = segment;
+        if (segment + phdr->p_memsz > end) end = segment + phdr->p_memsz;
+    }
+    if (start < end) {
+        _Block_main_image_start = start;
+        _Block_main_image_end = end;
+    }
+    return 1;
+}
+
+static void _Block_plans_init(void) {
+    dl_iterate_phdr(_Block_find_main_image, NULL);
+}
+
+static __inline bool _Block_plan_cacheable(struct Block_descriptor_1 *descriptor) {
+    return (uintptr_t)descriptor >= _Block_main_image_start && (uintptr_t)descriptor < _Block_main_image_end;
+}
+
+#endif
+
+static struct Block_plan *_Block_plan_create(struct Block_layout *aBlock) {
+#if BLOCK_LAYOUT_INTERPRETER
+    struct Block_capture captures[BLOCK_MAX_CAPTURES];
+    int count = _Block_layout_captures(aBlock, captures, BLOCK_MAX_CAPTURES);
+    struct Block_plan *plan = (struct Block_plan *)malloc(sizeof(struct Block_plan) + (count > 0 ? count : 0) * sizeof(struct Block_capture));
+    if (!plan) return NULL;
+    if (count > 0) memcpy(plan->captures, captures, count * sizeof(struct Block_capture));
+#else
+    int count = -1;
+    struct Block_plan *plan = (struct Block_plan *)malloc(sizeof(struct Block_plan));
+    if (!plan) return NULL;
+#endif
+    plan->descriptor = aBlock->descriptor;
+    plan->flags = aBlock->flags & BLOCK_PLAN_FLAGS;
+    plan->count = count;
+
+    struct Block_descriptor_2 *desc2 = _Block_descriptor_2(aBlock);
+    plan->copy = desc2 ? desc2->copy : NULL;
+    plan->dispose = desc2 ? desc2->dispose : NULL;
+
+    struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
+    plan->signature = desc3 ? desc3->signature : NULL;
+    plan->layout = desc3 ? desc3->layout : NULL;
+    return plan;
+}
+
+// 取得 aBlock 的 plan，第一次遇到它的 descriptor 时创建；哈希表满了返回 NULL
+// 调用者：_Block_call_copy_helper() / _Block_call_dispose_helper() / _Block_signature() / _Block_layout()
+static struct Block_plan *_Block_plan_for(struct Block_layout *aBlock) {
+    struct Block_descriptor_1 *descriptor = aBlock->descriptor;
+    int32_t flags = aBlock->flags & BLOCK_PLAN_FLAGS;
+    // descriptor 一般是 32 ~ 48 字节，连续地放在常量区中
+    uintptr_t index = ((uintptr_t)descriptor >> 4) ^ ((uintptr_t)descriptor >> 14);
+    struct Block_plan *created = NULL;
+
+    for (unsigned probe = 0; probe < BLOCK_PLAN_MAX_PROBES; probe++, index++) {
+        struct Block_plan * volatile *slot = &_Block_plans[index & (BLOCK_PLAN_TABLE_SIZE - 1)];
+        struct Block_plan *plan = *slot;
+        if (!plan) {
+            // 第一次遇到这个 descriptor，可能被卸载的就不缓存
+            pthread_once(&_Block_plans_once, _Block_plans_init);
+            if (!_Block_plan_cacheable(descriptor)) return NULL;
+            if (!created) created = _Block_plan_create(aBlock);
+            if (!created) return NULL;
+            if (OSAtomicCompareAndSwapPtr(NULL, created, slot)) return created;
+            plan = *slot; // 别的线程先填了这个槽，可能就是同一个 descriptor
+        }
+        if (plan->descriptor == descriptor && plan->flags == flags) {
+            free(created);
+            return plan;
+        }
+    }
+    free(created);
+    return NULL;
+}
+
+#endif // BLOCK_COPY_PLANS
+
+// 调用 block 的 copy helper 方法，即 Block_descriptor_2 中的 copy 方法
+// 有扩展布局时先试着直接按布局拷贝，见 Layout-driven copy and dispose
+// 调用者：_Block_copy_internal() / _Block_copy_nested()
+static void _Block_call_copy_helper(void *result, struct Block_layout *aBlock)
+{
+#if BLOCK_COPY_PLANS
+    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
+        struct Block_plan *plan = _Block_plan_for(aBlock);
+        if (plan) {
+#if BLOCK_LAYOUT_INTERPRETER
+            if (plan->count >= 0 && !isGC && !_Block_captures_need_helper(aBlock, plan->captures, plan->count)) {
+                _Block_copy_captures((struct Block_layout *)result, plan->captures, plan->count);
+                return;
+            }
+#endif
+            (*plan->copy)(result, aBlock);
+            return;
+        }
+    }
+#endif
+
+#if BLOCK_LAYOUT_INTERPRETER
+    if (!isGC && (aBlock->flags & BLOCK_HAS_EXTENDED_LAYOUT)) {
+        struct Block_capture captures[BLOCK_MAX_CAPTURES];
+        int count = _Block_layout_captures(aBlock, captures, BLOCK_MAX_CAPTURES);
+        if (count >= 0 && !_Block_captures_need_helper(aBlock, captures, count)) {
+            _Block_copy_captures((struct Block_layout *)result, captures, count);
+            return;
+        }
+    }
+#endif
+    
+    // 取得 block 中的 Block_descriptor_2
+    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
+    if (!desc) return; // 如果没有 Block_descriptor_2，就直接返回
+
+    // 调用 desc 中的 copy 方法，copy 方法中会调用 _Block_object_assign 函数
+    (*desc->copy)(result, aBlock); // do fixup
+}
+
+// 调用 block 的 dispose helper 方法，即 Block_descriptor_2 中的 dispose 方法
+// 有扩展布局时先试着直接按布局销毁
+// 调用者：_Block_release()
+static void _Block_call_dispose_helper(struct Block_layout *aBlock)
+{
+#if BLOCK_COPY_PLANS
+    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
+        struct Block_plan *plan = _Block_plan_for(aBlock);
+        if (plan) {
+#if BLOCK_LAYOUT_INTERPRETER
+            if (plan->count >= 0 && !isGC && !_Block_captures_need_helper(aBlock, plan->captures, plan->count)) {
+                _Block_dispose_captures(aBlock, plan->captures, plan->count);
+                return;
+            }
+#endif
+            (*plan->dispose)(aBlock);
+            return;
+        }
+    }
+#endif
+
+#if BLOCK_LAYOUT_INTERPRETER
+    if (!isGC && (aBlock->flags & BLOCK_HAS_EXTENDED_LAYOUT)) {
+        struct Block_capture captures[BLOCK_MAX_CAPTURES];
+        int count = _Block_layout_captures(aBlock, captures, BLOCK_MAX_CAPTURES);
+        if (count >= 0 && !_Block_captures_need_helper(aBlock, captures, count)) {
+            _Block_dispose_captures(aBlock, captures, count);
+            return;
+        }
+    }
+#endif
+    
+    // 取得 block 中的 Block_descriptor_2
+    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
+    if (!desc) return; // 如果没有 Block_descriptor_2，就直接返回
+
+    // 调用 desc 中的 dispose 方法，dispose 方法中会调用 _Block_object_dispose 函数
+    (*desc->dispose)(aBlock);
+}
+
+/****************************************************************************
+ Biased reference counting
+ 
+ 大部分堆上的 block 只在拷贝它的线程上 retain/release，每次都对 flags 做原子操作是浪费。
+ 从当前线程的 magazine 中分配的 block 打上 BLOCK_REFCOUNT_BIASED，这个线程就是它的 owner：
+ 1. owner 上的 retain/release 只改 reserved 高位中的 local count，不需要原子操作；
+ 2. 别的线程照常原子地改 flags 中的 shared count；
+ 3. local count 不为 0 时，shared count 中替它占 1 个（token），所以 shared count 不会先减到 0。
+    别的线程 release 时如果 shared count 只剩 token，说明它的引用记在 local count 上，
+    它不能改 local count，就把这次 release 挂到 owner 的 merges 链表上，owner 下次 retain/release 时合并；
+ 4. local count 减到 0 时（block 已经交给别的线程了），owner 去掉 BLOCK_REFCOUNT_BIASED 并还掉 token，
+    之后这个 block 和普通的 block 一样只用 shared count。
+ 
+ owner 线程退出时，它的 magazine 由之后新建的线程接手，local count 和挂着的 release 也一起交给那个线程。
+
+ 代价是 3 改变了 Block_release 的语义：最后一个引用在别的线程上 release 时，block 要等 owner 下次
+ retain/release（或者退出）时才销毁，dispose helper 也在 owner 线程上调用；owner 一直空闲或者阻塞着，
+ 被引入的对象就一直不释放。每次这样交接还要 malloc 一个 Block_merge。
+ 所以默认关闭，只适合 block 基本不离开拷贝它的线程的程序，用 _Block_use_biased_refcounts(true) 打开。
+ 编译时定义 BLOCK_BIASED_REFCOUNT=0 可以整个去掉。
+*****************************************************************************/
+
+#if BLOCK_BIASED_REFCOUNT
+
+#define BLOCK_BIASED_SHIFT 16
+#define BLOCK_BIASED_ONE (1 << BLOCK_BIASED_SHIFT)
+#define BLOCK_BIASED_MAX 0x7fff    // local count 满了以后，owner 也改 shared count
+
+static bool _Block_bias_refcounts = false;
+
+// 别的线程交给 owner 合并的一次 release
+struct Block_merge {
+    struct Block_merge *next;
+    struct Block_layout *block;
+};
+
+static void _Block_biased_drain(struct Block_magazine *magazine);
+
+// 新拷贝到堆上的 block 如果是从当前线程的 magazine 中分配的，就让当前线程做它的 owner
+// 调用者：_Block_copy_internal()
+static void _Block_biased_init(struct Block_layout *result, int32_t tag) {
+    if (!_Block_bias_refcounts || tag == 0 || tag == BLOCK_TAG_CUSTOM) return;
+    struct Block_magazine *magazine = _Block_current_block_magazine();
+    if (_Block_chunk_owner(result) != magazine) return;
+    if (magazine->merges) _Block_biased_drain(magazine);
+    result->reserved |= BLOCK_BIASED_ONE;
+    result->flags |= BLOCK_REFCOUNT_BIASED;
+}
+
+// owner 上 local count 减 1，减到 0 时去掉 BLOCK_REFCOUNT_BIASED 并还掉 token
+// 返回值是 block 是否需要被 dealloc
+static bool _Block_biased_local_release(struct Block_layout *aBlock) {
+    int32_t local = aBlock->reserved >> BLOCK_BIASED_SHIFT;
+    aBlock->reserved -= BLOCK_BIASED_ONE;
+    if (local > 1) return false;
+    __sync_fetch_and_and(&aBlock->flags, ~BLOCK_REFCOUNT_BIASED);
+    return latching_decr_int_should_deallocate(&aBlock->flags);
+}
+
+// owner 合并别的线程挂过来的 release
+static void _Block_biased_drain(struct Block_magazine *magazine) {
+    struct Block_merge *merge = __sync_lock_test_and_set(&magazine->merges, NULL);
+    while (merge) {
+        struct Block_merge *next = merge->next;
+        struct Block_layout *aBlock = merge->block;
+        free(merge);
+        if (_Block_biased_local_release(aBlock)) {
+            _Block_call_dispose_helper(aBlock);
+            _Block_callout_destructInstance(aBlock);
+            _Block_free_block(aBlock);
+        }
+        merge = next;
+    }
+}
+
+// owner 线程退出了：合并完挂着的 release 以后，在 merges 上放 BLOCK_MERGES_ABANDONED，
+// 之后别的线程持 _Block_slab_lock 直接改 local count，直到有新线程接手这个 magazine
+// 调用者：_Block_magazine_abandon()
+static void _Block_biased_abandon(struct Block_magazine *magazine) {
+    // pthread 调用 destructor 前已经把 key 清空了，合并时释放的 block 要还给这个 magazine
+    pthread_setspecific(_Block_block_heap.key, magazine);
+    while (!OSAtomicCompareAndSwapPtr(NULL, BLOCK_MERGES_ABANDONED, &magazine->merges)) {
+        _Block_biased_drain(magazine);
+    }
+    pthread_setspecific(_Block_block_heap.key, NULL);
+}
+
+// 对 BLOCK_REFCOUNT_BIASED 的 block 做 n 次 retain，返回 false 表示当前线程不是 owner
+// 或者 local count 放不下了，调用者改 shared count
+// 调用者：_Block_copy_internal() / _Block_copy_n()
+static bool _Block_biased_retain(struct Block_layout *aBlock, size_t n) {
+    struct Block_magazine *magazine = _Block_current_block_magazine();
+    if (!magazine || _Block_chunk_owner(aBlock) != magazine) return false;
+    if (magazine->merges) _Block_biased_drain(magazine);
+    if (!(aBlock->flags & BLOCK_REFCOUNT_BIASED)) return false;
+    if (n > (size_t)(BLOCK_BIASED_MAX - (aBlock->reserved >> BLOCK_BIASED_SHIFT))) return false;
+    aBlock->reserved += (int32_t)n * BLOCK_BIASED_ONE;
+    return true;
+}
+
+// 对 BLOCK_REFCOUNT_BIASED 的 block 做 release，*deallocate 中返回 block 是否需要被 dealloc
+// 返回 false 表示 block 已经不是 biased 的了，调用者改 shared count
+// 调用者：_Block_release()
+static bool _Block_biased_release(struct Block_layout *aBlock, bool *deallocate) {
+    *deallocate = false;
+    struct Block_magazine *owner = _Block_chunk_owner(aBlock);
+    if (owner == _Block_current_block_magazine()) {
+        if (owner->merges) _Block_biased_drain(owner);
+        if (!(aBlock->flags & BLOCK_REFCOUNT_BIASED)) return false;
+        *deallocate = _Block_biased_local_release(aBlock);
+        return true;
+    }
+    
+    // 别的线程
+    while (1) {
+        int32_t old_value = aBlock->flags;
+        if (!(old_value & BLOCK_REFCOUNT_BIASED)) return false;
+        if ((old_value & BLOCK_REFCOUNT_MASK) == BLOCK_REFCOUNT_MASK) {
+            return true; // latched high
+        }
+        if ((old_value & (BLOCK_REFCOUNT_MASK|BLOCK_REFCOUNT_SPILLED)) == (2|BLOCK_REFCOUNT_SPILLED)) {
+            if (_Block_refcount_unspill(&aBlock->flags, old_value)) return true;
+            continue;
+        }
+        if ((old_value & BLOCK_REFCOUNT_MASK) == 2) {
+            break; // 只剩 token 了，交给 owner
+        }
+        if (OSAtomicCompareAndSwapInt(old_value, old_value - 2, &aBlock->flags)) {
+            return true;
+        }
+    }
+    
+    struct Block_merge *merge = (struct Block_merge *)malloc(sizeof(struct Block_merge));
+    while (1) {
+        struct Block_merge *head = owner->merges;
+        if (head == BLOCK_MERGES_ABANDONED) {
+            // owner 线程已经退出了，没有线程会再改 local count，持锁自己改
+            pthread_mutex_lock(&_Block_slab_lock);
+            bool abandoned = (owner->merges == BLOCK_MERGES_ABANDONED);
+            if (abandoned) *deallocate = _Block_biased_local_release(aBlock);
+            pthread_mutex_unlock(&_Block_slab_lock);
+            if (abandoned) {
+                free(merge);
+                return true;
+            }
+            continue;
+        }
+        if (!merge) return true; // 只能泄漏了
+        merge->block = aBlock;
+        merge->next = head;
+        if (OSAtomicCompareAndSwapPtr(head, merge, &owner->merges)) return true;
+    }
+}
+
+void _Block_use_biased_refcounts(bool enable) {
+    _Block_bias_refcounts = enable;
+}
+
+#else
+
+static void _Block_biased_init(struct Block_layout *result __unused, int32_t tag __unused) {
+}
+
+static bool _Block_biased_retain(struct Block_layout *aBlock __unused, size_t n __unused) {
+    return false;
+}
+
+static bool _Block_biased_release(struct Block_layout *aBlock __unused, bool *deallocate __unused) {
+    return false;
+}
+
+void _Block_use_biased_refcounts(bool enable __unused) {
+}
+
+#endif // BLOCK_BIASED_REFCOUNT
+
+
+/*******************************************************************************
+Internal Support routines for copying
+********************************************************************************/
+
+#if !TARGET_OS_WIN32
+#pragma mark - Copy/Release support
+#endif
+
+// 把栈上的 block 或 byref 按位拷贝到新分配的内存中，两者不会重叠，所以不需要 memmove。
+// block 和 byref 的大小都是指针大小的整数倍（byref 中 __block 的 char、short 等除外），
+// 而且集中在 32 ~ 128 字节之间的少数几个值上（见 _Block_block_sizes）。
+// 每个常见的大小都用常量大小的 memcpy，编译器会展开成几条字或 SIMD 的 load/store，
+// 不用在 memmove 中再按大小、对齐和是否重叠分情况处理
+// 调用者：_Block_alloc_copy() / _Block_copy_coallocated() / _Block_copy_many() / _Block_copy_in_arena() / _Block_byref_assign_copy()
+#define BLOCK_BITCOPY_WORDS(_n) case _n: memcpy(dst, src, _n * sizeof(void *)); return
+
+static void _Block_bitcopy(void *dst, const void *src, size_t size) {
+    if (size % sizeof(void *) == 0) {
+        switch (size / sizeof(void *)) {
+            BLOCK_BITCOPY_WORDS(1);
+            BLOCK_BITCOPY_WORDS(2);
+            BLOCK_BITCOPY_WORDS(3);
+            BLOCK_BITCOPY_WORDS(4);
+            BLOCK_BITCOPY_WORDS(5);
+            BLOCK_BITCOPY_WORDS(6);
+            BLOCK_BITCOPY_WORDS(7);
+            BLOCK_BITCOPY_WORDS(8);
+            BLOCK_BITCOPY_WORDS(9);
+            BLOCK_BITCOPY_WORDS(10);
+            BLOCK_BITCOPY_WORDS(12);
+            BLOCK_BITCOPY_WORDS(14);
+          default:
+            break;
+        }
+    }
+    memcpy(dst, src, size);
 }
 
-// 判断 block 是否有扩展布局（extended layout），扩展布局存在 Block_descriptor_3 中
+#undef BLOCK_BITCOPY_WORDS
+
+#if BLOCK_COALLOCATION
+
+static void _Block_copy_nested(struct Block_layout *result, struct Block_layout *aBlock, const bool nested);
+
+// 把栈上的 block 和它第一次拷贝到堆上的 byref 放到同一块内存中，详见 Block_coalloc_header。
+// 没有需要拷贝的 byref，或者不知道有哪些 byref 时返回 NULL，由调用者按正常方式拷贝。
 // 调用者：_Block_copy_internal()
-static __inline bool _Block_has_layout(struct Block_layout *aBlock) {
-    // 如果没有指定有签名，即没有 Block_descriptor_3，就返回 false
-    if (! (aBlock->flags & BLOCK_HAS_SIGNATURE)) return false;
+static struct Block_layout *_Block_copy_coallocated(struct Block_layout *aBlock) {
+    size_t offsets[BLOCK_COALLOC_MAX_BYREFS];
+    int count = _Block_layout_byref_offsets(aBlock, offsets, BLOCK_COALLOC_MAX_BYREFS);
+    if (count <= 0) return NULL;
     
-    // 先取得 Block_descriptor_1 的地址
-    uint8_t *desc = (uint8_t *)aBlock->descriptor;
+    struct Block_coalloc_context context;
+    context.count = 0;
+    size_t blockSize = BLOCK_COALLOC_ALIGN(aBlock->descriptor->size);
+    size_t total = sizeof(struct Block_coalloc_header) + sizeof(struct Block_coalloc_slot) + blockSize;
     
-    // 先偏移 Block_descriptor_1 的大小
-    desc += sizeof(struct Block_descriptor_1);
+    for (int i = 0; i < count; i++) {
+        struct Block_byref *src = *(struct Block_byref **)((char *)aBlock + offsets[i]);
+        // 只有还在栈上的 byref 这次才会被拷贝
+        if (!src || (src->forwarding->flags & (BLOCK_REFCOUNT_MASK|BLOCK_BYREF_IS_GC))) continue;
+        context.sources[context.count++] = src;
+        total += sizeof(struct Block_coalloc_slot) + BLOCK_COALLOC_ALIGN(src->size);
+    }
+    if (context.count == 0) return NULL;
     
-    // 如果还有 Block_descriptor_2，就再偏移 Block_descriptor_2 的大小，得到的就是 Block_descriptor_3 的地址
-    if (aBlock->flags & BLOCK_HAS_COPY_DISPOSE) {
-        desc += sizeof(struct Block_descriptor_2);
+    int32_t tag;
+    struct Block_coalloc_header *header = _Block_alloc_memory(BLOCK_HEAP_BLOCKS, total, &tag);
+    if (!header) return NULL;
+    header->live = 1 + context.count;
+    header->tag = tag;
+    header->size = total;
+    context.header = header;
+    
+    struct Block_coalloc_slot *blockSlot = (struct Block_coalloc_slot *)(header + 1);
+    blockSlot->header = header;
+    struct Block_layout *result = (struct Block_layout *)(blockSlot + 1);
+    char *cursor = (char *)result + blockSize;
+    for (unsigned i = 0; i < context.count; i++) {
+        struct Block_coalloc_slot *slot = (struct Block_coalloc_slot *)cursor;
+        slot->header = header;
+        context.copies[i] = (struct Block_byref *)(slot + 1);
+        cursor += sizeof(struct Block_coalloc_slot) + BLOCK_COALLOC_ALIGN(context.sources[i]->size);
     }
     
-    // 看 Block_descriptor_3 中的 layout 是否非空
-    return ((struct Block_descriptor_3 *)desc)->layout != NULL;
-}    
+    _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
+    result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+    result->flags |= BLOCK_NEEDS_FREE | BLOCK_COALLOCATED | 2;  // logical refcount 1
+    result->reserved = 0;
+    result->isa = _NSConcreteMallocBlock;
+    
+    // copy helper 拷贝 byref 时会用到预留的空间
+    {
+        struct Block_coalloc_context *installed __attribute__((cleanup(_Block_coalloc_leave))) = &context;
+        context.previous = _Block_coalloc_current;
+        _Block_coalloc_current = installed;
+        _Block_copy_nested(result, aBlock, false);
+    }
+    
+    // 没用上的空间（比如 byref 在这期间已经被别人拷贝了）就不算活着的子对象了
+    for (unsigned i = 0; i < context.count; i++) {
+        if (context.copies[i]) _Block_coalloc_release(header);
+    }
+    return result;
+}
 
-// 调用 block 的 copy helper 方法，即 Block_descriptor_2 中的 copy 方法
-// 调用者：_Block_copy_internal()
-static void _Block_call_copy_helper(void *result, struct Block_layout *aBlock)
-{
-    // 取得 block 中的 Block_descriptor_2
-    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
-    if (!desc) return; // 如果没有 Block_descriptor_2，就直接返回
+#endif // BLOCK_COALLOCATION
 
-    // 调用 desc 中的 copy 方法，copy 方法中会调用 _Block_object_assign 函数
-    (*desc->copy)(result, aBlock); // do fixup
+/****************************************************************************
+ Iterative copy and dispose of nested blocks
+
+ block 引入了另一个栈上的 block 时，copy helper 调用 _Block_object_assign()，它又调用 _Block_copy_internal()
+ 拷贝里面的 block，再调用里面那个 block 的 copy helper……嵌套多少层就递归多少层，很深的 continuation 链会把栈用光。
+ dispose 也一样：dispose helper 调用 _Block_object_dispose()，里面的 block 引用计数减到 0 时又调用它的 dispose helper。
+
+ 现在最外层的 _Block_copy_internal() 在当前线程上登记一个 worklist，copy helper 中经过 _Block_object_assign()
+ 拷贝被引入的 block 时（nested 为 true）发现有 worklist，只分配内存、按位拷贝，把 (拷贝, 原件) 放进 worklist 就返回，
+ 由最外层的循环接着调用它们的 copy helper。被推迟的原件都是被引入的 block，在最外层调用者的栈帧之内，调用 helper 时它们还在。
+ _Block_release() 同理，里面的 block 引用计数减到 0 时只是放进 worklist，由最外层的 _Block_release() 销毁。
+ 这样不管嵌套多深，栈上最多多出一层 helper 的调用。
+
+ 只有 _Block_object_assign() 的拷贝可以推迟。Block_copy 等公开的入口（可能是 C++ 的拷贝构造函数、byref 的 keep helper
+ 或者 copy helper 中手写的代码调用的）返回时 block 必须已经拷贝完，原件可能马上就失效了，所以它们总是登记一个新的
+ worklist，返回前处理完，不管外面是不是已经有一个。arena、_Block_copy_many()、Block_storage_t 和 co-allocation
+ （copy helper 拷贝 byref 时要用到预留的空间，只能立即调用）的拷贝也一样。
+*****************************************************************************/
+
+#define BLOCK_WORKLIST_INLINE 16
+
+struct Block_work {
+    struct Block_layout *block;     // 要调用 copy helper 的拷贝，或者要销毁的 block
+    struct Block_layout *source;    // 拷贝的原件，销毁时为 NULL
+};
+
+// 放在最外层调用者的栈上，不够时换成 malloc 的
+struct Block_worklist {
+    struct Block_worklist **current; // 登记在哪个线程变量上，没有登记（交给了外面的 worklist）时为 NULL
+    struct Block_worklist *previous; // 外面一层的 worklist，结束时恢复
+    struct Block_work *items;
+    size_t count;
+    size_t capacity;
+    struct Block_work buffer[BLOCK_WORKLIST_INLINE];
+};
+
+// 当前线程上最里层的 worklist。每次拷贝、销毁带 helper 的 block 都要读写，用 __thread 而不是 pthread key
+static __thread struct Block_worklist *_Block_copy_worklist;
+static __thread struct Block_worklist *_Block_dispose_worklist;
+
+// 离开作用域时恢复外面那个 worklist。helper 中抛出 C++ 异常（比如被引入对象的拷贝构造函数）时栈展开也会调用它，
+// 不然线程变量会一直指向已经销毁的栈帧。展开时执行 cleanup 要求 runtime 用 -fexceptions 编译
+static void _Block_worklist_end(struct Block_worklist *local) {
+    if (!local->current) return;
+    *local->current = local->previous;
+    if (local->items != local->buffer) free(local->items);
 }
 
-// 调用 block 的 dispose helper 方法，即 Block_descriptor_2 中的 dispose 方法
-// 调用者：_Block_release()
-static void _Block_call_dispose_helper(struct Block_layout *aBlock)
-{
-    // 取得 block 中的 Block_descriptor_2
-    struct Block_descriptor_2 *desc = _Block_descriptor_2(aBlock);
-    if (!desc) return; // 如果没有 Block_descriptor_2，就直接返回
+#define BLOCK_WORKLIST_SCOPE __attribute__((cleanup(_Block_worklist_end)))
 
-    // 调用 desc 中的 dispose 方法，dispose 方法中会调用 _Block_object_dispose 函数
-    (*desc->dispose)(aBlock);
+// nested 并且当前线程上已经有 worklist 的话返回它；否则把 local 登记为当前线程的 worklist，返回 NULL，调用者就是最外层。
+// local 要用 BLOCK_WORKLIST_SCOPE 声明
+static struct Block_worklist *_Block_worklist_begin(struct Block_worklist **current, struct Block_worklist *local, const bool nested) {
+    struct Block_worklist *active = *current;
+    if (active && nested) {
+        local->current = NULL;
+        return active;
+    }
+    local->current = current;
+    local->previous = active;
+    local->items = local->buffer;
+    local->count = 0;
+    local->capacity = BLOCK_WORKLIST_INLINE;
+    *current = local;
+    return NULL;
 }
 
-/*******************************************************************************
-Internal Support routines for copying
-********************************************************************************/
+// 内存不够时返回 false，调用者就地处理
+static bool _Block_worklist_push(struct Block_worklist *list, struct Block_layout *block, struct Block_layout *source) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity * 2;
+        struct Block_work *items = (struct Block_work *)malloc(capacity * sizeof(struct Block_work));
+        if (!items) return false;
+        memcpy(items, list->items, list->count * sizeof(struct Block_work));
+        if (list->items != list->buffer) free(list->items);
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count].block = block;
+    list->items[list->count].source = source;
+    list->count++;
+    return true;
+}
 
-#if !TARGET_OS_WIN32
-#pragma mark - Copy/Release support
-#endif
+// 销毁引用计数已经减到 0 的 block
+// 调用者：_Block_release() / _Block_dispose_nested() / _Block_release_many()
+static void _Block_deallocate(struct Block_layout *aBlock) {
+    // 调用 block 的 dispose helper，dispose helper 方法中会做诸如销毁 byref 等操作
+    _Block_call_dispose_helper(aBlock);
+
+    // 非 GC 下的 _Block_destructInstance 啥也不干，函数体是空的
+    _Block_callout_destructInstance(aBlock);
+
+    // 还给 slab，或者 free
+    _Block_free_block(aBlock);
+}
+
+// 拷贝到堆上的 block 调用 copy helper，helper 中遇到的嵌套 block 都放进 worklist，在这里一个一个处理。
+// nested 为 true 时（_Block_object_assign() 拷贝被引入的 block）交给外面已经登记的 worklist；
+// 否则立即调用 helper，返回前把 worklist 处理完
+// 调用者：_Block_copy_internal() / _Block_copy_coallocated() / _Block_copy_many() / _Block_copy_in_arena() / _Block_storage_init()
+static void _Block_copy_nested(struct Block_layout *result, struct Block_layout *aBlock, const bool nested) {
+    if (!(aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) return; // 没有 helper，不会再拷贝别的 block
+
+    struct Block_worklist local BLOCK_WORKLIST_SCOPE;
+    struct Block_worklist *active = _Block_worklist_begin(&_Block_copy_worklist, &local, nested);
+    if (active && _Block_worklist_push(active, result, aBlock)) return;
+
+    _Block_call_copy_helper(result, aBlock);
+    if (active) return;
+
+    // 后进先出，刚拷贝的 block 和它引入的 block 一般挨得很近
+    while (local.count) {
+        struct Block_work work = local.items[--local.count];
+        _Block_call_copy_helper(work.block, work.source);
+    }
+}
+
+// 销毁引用计数已经减到 0 的 block，dispose helper 中引用计数减到 0 的嵌套 block 都放进 worklist，在这里一个一个销毁
+// 调用者：_Block_release() / _Block_release_many()
+static void _Block_dispose_nested(struct Block_layout *aBlock) {
+    if (!(aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) {
+        _Block_deallocate(aBlock); // 没有 helper，不会再释放别的 block
+        return;
+    }
+
+    struct Block_worklist local BLOCK_WORKLIST_SCOPE;
+    struct Block_worklist *active = _Block_worklist_begin(&_Block_dispose_worklist, &local, true);
+    if (active && _Block_worklist_push(active, aBlock, NULL)) return;
+
+    _Block_deallocate(aBlock);
+    if (active) return;
+
+    while (local.count) {
+        _Block_deallocate(local.items[--local.count].block);
+    }
+}
+
+// 把栈上的 block 按位拷贝到堆上，isa、flags 和 reserved 设置成引用计数为 1 的 malloc block，不调用 copy helper
+// 调用者：_Block_copy_internal()
+static struct Block_layout *_Block_alloc_copy(struct Block_layout *aBlock) {
+    // 在堆上重新开辟一块和 aBlock 相同大小的内存，小的 block 从 slab 中分配（除非装了自定义的分配器）
+    int32_t tag;
+    struct Block_layout *result = _Block_alloc_memory(BLOCK_HEAP_BLOCKS, aBlock->descriptor->size, &tag);
+    if (!result) return NULL; // 开辟失败，返回 NULL
+    
+    // 将 aBlock 内存上的数据全部移到新开辟的 result 上
+    _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
+    
+    // 记下是从哪个 size class 分配的，释放时要用
+    result->reserved = tag;
+    
+    // reset refcount
+    // 将 flags 中的 BLOCK_REFCOUNT_MASK 和 BLOCK_DEALLOCATING 部分的位全部清为 0
+    result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);    // XXX not needed
+    
+    // 将 result 标记位在堆上，需要手动释放；并且引用计数初始化为 1
+    result->flags |= BLOCK_NEEDS_FREE | 2;  // logical refcount 1
+    
+    // 从当前线程的 magazine 中分配的，由当前线程做 owner，这个 1 变成 token，引用计数记在 local count 上
+    _Block_biased_init(result, tag);
+    
+    // isa 变为 _NSConcreteMallocBlock
+    result->isa = _NSConcreteMallocBlock;
+    return result;
+}
 
 // Copy, or bump refcount, of a block.  If really copying, call the copy helper if present.
 // 拷贝 block，
@@ -403,7 +2237,7 @@ Internal Support routines for copying
 // 参数 wantsOne 用于 GC，不必深究
 // 返回值是拷贝后的 block 的地址
 // 调用者：_Block_copy() / _Block_copy_collectable() / _Block_object_assign()
-static void *_Block_copy_internal(const void *arg, const bool wantsOne) {
+static void *_Block_copy_internal(const void *arg, const bool wantsOne, const bool nested) {
     struct Block_layout *aBlock;
 
     if (!arg) return NULL; // 如果 arg 为 NULL，直接返回 NULL
@@ -413,6 +2247,10 @@ static void *_Block_copy_internal(const void *arg, const bool wantsOne) {
     aBlock = (struct Block_layout *)arg; // 强转为 Block_layout 类型
     
     if (aBlock->flags & BLOCK_NEEDS_FREE) { // 如果现在已经在堆上
+        // 当前线程是 owner 的话，只加 local count
+        if ((aBlock->flags & BLOCK_REFCOUNT_BIASED) && _Block_biased_retain(aBlock, 1)) {
+            return aBlock;
+        }
         // latches on high
         latching_incr_int(&aBlock->flags); // 就只将引用计数加 1
         return aBlock;
@@ -425,7 +2263,7 @@ static void *_Block_copy_internal(const void *arg, const bool wantsOne) {
         }
         return aBlock;
     }
-    else if (aBlock->flags & BLOCK_IS_GLOBAL) { // 如果 block 在全局区，不用加引用计数，也不用拷贝，直接返回 block 本身
+    else if (aBlock->flags & (BLOCK_IS_GLOBAL|BLOCK_IS_ARENA)) { // 如果 block 在全局区或者 arena 中，不用加引用计数，也不用拷贝，直接返回 block 本身
         return aBlock;
     }
 
@@ -434,26 +2272,20 @@ static void *_Block_copy_internal(const void *arg, const bool wantsOne) {
     // block 现在在栈上，现在需要将其拷贝到堆上
     
     if (!isGC) { // 如果不是 GC，我们只关心不是 GC 的情况
-        // 在堆上重新开辟一块和 aBlock 相同大小的内存
-        struct Block_layout *result = malloc(aBlock->descriptor->size);
+#if BLOCK_COALLOCATION
+        // 带 __block 变量的 block，和 byref 一起分配
+        if (_Block_coallocate_byrefs && (aBlock->flags & BLOCK_HAS_COPY_DISPOSE)) {
+            struct Block_layout *result = _Block_copy_coallocated(aBlock);
+            if (result) return result;
+        }
+#endif
+        // 在堆上开辟内存，把 aBlock 的数据拷贝过去，引用计数为 1
+        struct Block_layout *result = _Block_alloc_copy(aBlock);
         if (!result) return NULL; // 开辟失败，返回 NULL
         
-        // 将 aBlock 内存上的数据全部移到新开辟的 result 上
-        memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
-        
-        // reset refcount
-        // 将 flags 中的 BLOCK_REFCOUNT_MASK 和 BLOCK_DEALLOCATING 部分的位全部清为 0
-        result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);    // XXX not needed
-        
-        // 将 result 标记位在堆上，需要手动释放；并且引用计数初始化为 1
-        result->flags |= BLOCK_NEEDS_FREE | 2;  // logical refcount 1
-        
-        // isa 变为 _NSConcreteMallocBlock
-        result->isa = _NSConcreteMallocBlock;
-        
         // 调用 copy helper，即 Block_descriptor_2 中的 copy 方法
-        // copy 方法中会调用做拷贝成员变量的工作
-        _Block_call_copy_helper(result, aBlock);
+        // copy 方法中会调用做拷贝成员变量的工作，其中嵌套的 block 不递归拷贝，见 Iterative copy and dispose of nested blocks
+        _Block_copy_nested(result, aBlock, nested);
         return result;
     }
     
@@ -464,7 +2296,7 @@ static void *_Block_copy_internal(const void *arg, const bool wantsOne) {
         bool hasCTOR = (flags & BLOCK_HAS_CTOR) != 0;
         struct Block_layout *result = _Block_allocator(aBlock->descriptor->size, wantsOne, hasCTOR || _Block_has_layout(aBlock));
         if (!result) return NULL;
-        memmove(result, aBlock, aBlock->descriptor->size); // bitcopy first
+        _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
         // reset refcount
         // if we copy a malloc block to a GC block then we need to clear NEEDS_FREE.
         flags &= ~(BLOCK_NEEDS_FREE|BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);   // XXX not needed
@@ -521,14 +2353,27 @@ static void _Block_byref_assign_copy(void *dest, // 指向目标地址的二级
         bool isWeak = ((flags & (BLOCK_FIELD_IS_BYREF|BLOCK_FIELD_IS_WEAK)) == (BLOCK_FIELD_IS_BYREF|BLOCK_FIELD_IS_WEAK));
         
         // if its weak ask for an object (only matters under GC)
-        // 为新的 byref 在堆中分配内存，isWeak 只对 GC 下有用，其他情况只是单纯得调用 _Block_alloc_default，里面只是 malloc(size)
-        struct Block_byref *copy = (struct Block_byref *)_Block_allocator(src->size, false, isWeak);
+        // 为新的 byref 在堆中分配内存，isWeak 只对 GC 下有用；非 GC 下从 byref 专用的 slab heap 中分配
+        struct Block_byref *copy;
+        int32_t tag = 0;
+        bool coallocated = false;
+        if (!isGC) {
+            // 如果正在拷贝的 block 为它预留了空间，就直接用
+            copy = _Block_coalloc_take(src);
+            coallocated = (copy != NULL);
+            if (!copy) copy = (struct Block_byref *)_Block_alloc_memory(BLOCK_HEAP_BYREFS, src->size, &tag);
+        }
+        else {
+            copy = (struct Block_byref *)_Block_allocator(src->size, false, isWeak);
+        }
         
         // _Byref_flag_initial_value = BLOCK_BYREF_NEEDS_FREE | 4，即新 byref 的 flags 中标记了它是在堆上，且引用计数为 2。
         // 为什么是 2 呢？注释说的是 non-GC one for caller, one for stack
         // one for caller 很好理解，那 one for stack 是为什么呢？
         // 看下面的代码中有一行 src->forwarding = copy。src 的 forwarding 也指向了 copy，相当于引用了 copy。
-        copy->flags = src->flags | _Byref_flag_initial_value; // non-GC one for caller, one for stack
+        // 同时记下 slab 的 size class，释放时要用
+        copy->flags = src->flags | _Byref_flag_initial_value | (tag << BLOCK_BYREF_SLAB_CLASS_SHIFT); // non-GC one for caller, one for stack
+        if (coallocated) copy->flags |= BLOCK_BYREF_COALLOCATED;
         
         // 堆上 byref 的 forwarding 指向自己
         copy->forwarding = copy; // patch heap copy to point to itself (skip write-barrier)
@@ -572,8 +2417,14 @@ static void _Block_byref_assign_copy(void *dest, // 指向目标地址的二级
             // This copy includes Block_byref_3, if any.
             // _Block_memmove 在非 GC 下的默认实现只是 memmove
             // 将 Block_byref 后面的数据都拷贝到 copy 中，一定包括 Block_byref_3
-            _Block_memmove(copy+1, src+1,
-                           src->size - sizeof(struct Block_byref));
+            // 非 GC 下不用经过函数指针，直接用按大小特化的拷贝
+            if (!isGC) {
+                _Block_bitcopy(copy+1, src+1, src->size - sizeof(struct Block_byref));
+            }
+            else {
+                _Block_memmove(copy+1, src+1,
+                               src->size - sizeof(struct Block_byref));
+            }
         }
     }
     
@@ -586,7 +2437,7 @@ static void _Block_byref_assign_copy(void *dest, // 指向目标地址的二级
     // assign byref data block pointer into new Block
     // _Block_assign 在非 GC 下的默认实现只是 *destp = src->forwarding
     // 即 destp 指向的指针，指向堆上的 byref 对象（src->forwarding 在上面已经指向了堆上的 byref）
-    _Block_assign(src->forwarding, (void **)destp);
+    _Block_callout_assign(src->forwarding, (void **)destp);
 }
 
 
@@ -627,8 +2478,8 @@ static void _Block_byref_release(const void *arg) {
             (*byref2->byref_destroy)(byref);
         }
         
-        // 非 GC 下的 _Block_deallocator 的默认实现就是 free
-        _Block_deallocator((struct Block_layout *)byref);
+        // 还给 slab，或者 free
+        _Block_free_byref(byref);
     }
 }
 
@@ -650,11 +2501,111 @@ static void _Block_byref_release(const void *arg) {
 
 // 拷贝 block，详情见 _Block_copy_internal
 void *_Block_copy(const void *arg) {
-    return _Block_copy_internal(arg, true);
+    return _Block_copy_internal(arg, true, false);
+}
+
+// copy helper 抛出 C++ 异常时也要恢复原来的设置，见 Block_worklist
+static void _Block_restore_placement_node(int *previous) {
+    _Block_set_placement_node(*previous);
+}
+
+// 和 _Block_copy 一样，但是如果真的要拷贝到堆上，block 和它拷贝到堆上的 byref、被引入的 block
+// 都放在 NUMA node 上，通常是之后要运行这个 block 的线程所在的 node（见 _Block_current_numa_node()）
+void *_Block_copy_to_node(const void *arg, int node) {
+    if (node < 0 || node >= BLOCK_MAX_NUMA_NODES) {
+        return _Block_copy_internal(arg, true, false);
+    }
+    int previous __attribute__((cleanup(_Block_restore_placement_node))) = _Block_set_placement_node(node);
+    return _Block_copy_internal(arg, true, false);
+}
+
+// 和调用 n 次 Block_copy 的效果一样：栈上的 block 只拷贝一次，堆上的 block 引用计数一次加 n。
+// 返回的 block 要 release n 次。n 为 0 时返回 NULL
+void *_Block_copy_n(const void *arg, size_t n) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock || n == 0) return NULL;
+    
+    // 栈上的 block 拷贝以后已经有 1 个引用了
+    if (!(aBlock->flags & BLOCK_NEEDS_FREE)) {
+        aBlock = _Block_copy_internal(aBlock, true, false);
+        if (!aBlock || !(aBlock->flags & BLOCK_NEEDS_FREE)) return aBlock; // 全局区、arena 中的 block 和 GC
+        n--;
+    }
+    if (n == 0) return aBlock;
+    
+    if ((aBlock->flags & BLOCK_REFCOUNT_BIASED) && _Block_biased_retain(aBlock, n)) {
+        return aBlock;
+    }
+    latching_add_int(&aBlock->flags, n);
+    return aBlock;
 }
 
+// 和对每个 block 调用 Block_copy 一样，结果放在 copies 中。
+// 栈上的 block 一起放在一块内存中（布局和 co-allocation 一样），只分配一次，
+// 这块内存要等其中的 block 全部释放以后才会还给 heap，所以适合一起入队、差不多同时执行完的 block
+void _Block_copy_many(const void **blocks, void **copies, size_t n) {
+#if BLOCK_COALLOCATION
+    size_t total = sizeof(struct Block_coalloc_header);
+    int32_t count = 0;
+    if (!isGC) {
+        for (size_t i = 0; i < n; i++) {
+            struct Block_layout *aBlock = (struct Block_layout *)blocks[i];
+            if (!aBlock || (aBlock->flags & (BLOCK_NEEDS_FREE|BLOCK_IS_GC|BLOCK_IS_GLOBAL|BLOCK_IS_ARENA))) continue;
+            total += sizeof(struct Block_coalloc_slot) + BLOCK_COALLOC_ALIGN(aBlock->descriptor->size);
+            count++;
+        }
+    }
+    
+    int32_t tag;
+    struct Block_coalloc_header *header = NULL;
+    if (count > 1) {
+        header = _Block_alloc_memory(BLOCK_HEAP_BLOCKS, total, &tag);
+    }
+    if (header) {
+        header->live = count;
+        header->tag = tag;
+        header->size = total;
+        
+        char *cursor = (char *)(header + 1);
+        for (size_t i = 0; i < n; i++) {
+            struct Block_layout *aBlock = (struct Block_layout *)blocks[i];
+            if (!aBlock || (aBlock->flags & (BLOCK_NEEDS_FREE|BLOCK_IS_GC|BLOCK_IS_GLOBAL|BLOCK_IS_ARENA))) {
+                copies[i] = _Block_copy_internal(aBlock, true, false);
+                continue;
+            }
+            struct Block_coalloc_slot *slot = (struct Block_coalloc_slot *)cursor;
+            slot->header = header;
+            struct Block_layout *result = (struct Block_layout *)(slot + 1);
+            cursor += sizeof(struct Block_coalloc_slot) + BLOCK_COALLOC_ALIGN(aBlock->descriptor->size);
+            
+            _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
+            result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+            result->flags |= BLOCK_NEEDS_FREE | BLOCK_COALLOCATED | 2;  // logical refcount 1
+            result->reserved = 0;
+            result->isa = _NSConcreteMallocBlock;
+            _Block_copy_nested(result, aBlock, false);
+            copies[i] = result;
+        }
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        copies[i] = _Block_copy_internal(blocks[i], true, false);
+    }
+}
 
 // API entry point to release a copied Block
+// 堆上的 block 引用计数减 1，返回值是 block 是否需要被销毁
+// biased 的 block 先交给 _Block_biased_release()
+// 调用者：_Block_release() / _Block_release_many()
+static bool _Block_release_should_deallocate(struct Block_layout *aBlock) {
+    bool deallocate;
+    if ((aBlock->flags & BLOCK_REFCOUNT_BIASED) && _Block_biased_release(aBlock, &deallocate)) {
+        return deallocate;
+    }
+    return latching_decr_int_should_deallocate(&aBlock->flags);
+}
+
 // 对 block 做 release 操作。
 // block 在堆上，才需要 release，在全局区和栈区都不需要 release.
 // 先将引用计数减 1，如果引用计数减到了 0，就将 block 销毁
@@ -681,17 +2632,81 @@ void _Block_release(const void *arg) {
     else if (aBlock->flags & BLOCK_NEEDS_FREE) {
         
         // 引用计数减 1，如果引用计数减到了 0，会返回 true，表示 block 需要被销毁
-        if (latching_decr_int_should_deallocate(&aBlock->flags)) {
-            
-            // 调用 block 的 dispose helper，dispose helper 方法中会做诸如销毁 byref 等操作
-            _Block_call_dispose_helper(aBlock);
-            
-            // 非 GC 下的 _Block_destructInstance 啥也不干，函数体是空的
-            _Block_destructInstance(aBlock);
-            
-            // 非 GC 下的 _Block_deallocator 的默认实现就是 free
-            _Block_deallocator(aBlock);
+        if (_Block_release_should_deallocate(aBlock)) {
+            // 调用 dispose helper 并释放内存，其中嵌套的 block 不递归销毁
+            _Block_dispose_nested(aBlock);
+        }
+    }
+}
+
+#define BLOCK_RELEASE_BATCH 64
+
+// 一次 release 多个 block。
+// 引用计数减到 0 的 block 按 descriptor 排好，连着调用 dispose helper（同一个 descriptor 的 helper
+// 和被引入变量的布局都还在缓存中），最后一起把内存还给 slab。每次最多处理 BLOCK_RELEASE_BATCH 个
+void _Block_release_many(const void **blocks, size_t n) {
+    struct Block_layout *dead[BLOCK_RELEASE_BATCH];
+    void *ptrs[BLOCK_RELEASE_BATCH];
+    int32_t tags[BLOCK_RELEASE_BATCH];
+    
+    size_t i = 0;
+    while (i < n) {
+        // 先把引用计数都减掉，收集要销毁的
+        size_t count = 0;
+        for (; i < n && count < BLOCK_RELEASE_BATCH; i++) {
+            struct Block_layout *aBlock = (struct Block_layout *)blocks[i];
+            if (!aBlock || (aBlock->flags & (BLOCK_IS_GLOBAL|BLOCK_NEEDS_FREE)) != BLOCK_NEEDS_FREE) {
+                _Block_release(aBlock); // 全局区、栈上、GC 的 block
+                continue;
+            }
+            if (_Block_release_should_deallocate(aBlock)) {
+                dead[count++] = aBlock;
+            }
         }
+        
+        // 按 descriptor 排序，个数很少，插入排序就够了
+        for (size_t j = 1; j < count; j++) {
+            struct Block_layout *aBlock = dead[j];
+            size_t k = j;
+            for (; k > 0 && (uintptr_t)dead[k-1]->descriptor > (uintptr_t)aBlock->descriptor; k--) {
+                dead[k] = dead[k-1];
+            }
+            dead[k] = aBlock;
+        }
+        
+        // 和 _Block_dispose_nested() 一样登记 dispose worklist，dispose helper 中引用计数减到 0 的嵌套 block
+        // 不递归销毁，放进 worklist 在这一批之后一个一个销毁
+        {
+            struct Block_worklist local BLOCK_WORKLIST_SCOPE;
+            struct Block_worklist *active = _Block_worklist_begin(&_Block_dispose_worklist, &local, true);
+            if (active) {
+                // 在别的 block 的 dispose helper 中调用的，交给最外层的调用者销毁
+                for (size_t j = 0; j < count; j++) {
+                    _Block_dispose_nested(dead[j]);
+                }
+                continue;
+            }
+            for (size_t j = 0; j < count; j++) {
+                _Block_call_dispose_helper(dead[j]);
+                _Block_callout_destructInstance(dead[j]);
+            }
+            while (local.count) {
+                _Block_deallocate(local.items[--local.count].block);
+            }
+        }
+        
+        // 从 slab 或者 malloc 分配的一起释放，co-allocated 的和自定义分配器分配的还是一个一个来
+        size_t batched = 0;
+        for (size_t j = 0; j < count; j++) {
+            int32_t tag = dead[j]->reserved & BLOCK_RESERVED_TAG_MASK;
+            if ((dead[j]->flags & BLOCK_COALLOCATED) || tag == BLOCK_TAG_CUSTOM) {
+                _Block_free_block(dead[j]);
+                continue;
+            }
+            ptrs[batched] = dead[j];
+            tags[batched++] = tag;
+        }
+        _Block_heap_free_many(BLOCK_HEAP_BLOCKS, ptrs, tags, batched);
     }
 }
 
@@ -725,6 +2740,256 @@ static void _Block_destroy(const void *arg) {
 
 
 
+/************************************************************
+ *
+ * Arena-scoped copies
+ *
+ 
+ 把 block 拷贝到调用者提供的 arena 中，arena 销毁时统一调用所有 block 的 dispose helper，
+ 然后一次性释放全部内存。
+ arena 中的 block 不做引用计数：对它们调用 _Block_copy 直接返回 block 本身，_Block_release 什么都不做，
+ 就像全局区的 block 一样。所以它们不能比 arena 活得更久。
+ 
+ arena 的内存由若干 chunk 组成，每次拷贝从当前 chunk 中切一段出来，每段前面有一个 Block_arena_entry 头部，
+ 销毁时按顺序遍历所有 chunk 就能找到每一个 block。
+ 
+ arena 不是线程安全的，同一时间只能在一个线程上使用。
+ ***********************************************************/
+
+#define BLOCK_ARENA_DEFAULT_CHUNK_SIZE  4096
+#define BLOCK_ARENA_ALIGN(_x)           (((_x) + 15) & ~(size_t)15)
+
+enum {
+    BLOCK_ARENA_ENTRY_COPY = 1,     // entry 中是一个拷贝进来的 block
+    BLOCK_ARENA_ENTRY_RETAIN = 2,   // entry 中是一个指针，指向被 retain 的堆上的 block，arena 销毁时 release
+};
+
+struct Block_arena_entry {
+    uint32_t size;  // 整个 entry 的大小，包括头部
+    uint32_t kind;
+    uint64_t pad;   // 保证后面的 block 16 字节对齐
+};
+
+struct Block_arena_chunk {
+    struct Block_arena_chunk *next;
+    char *top;      // 已经用到哪里了，当前 chunk 的这个值在 arena->bump 中
+    bool needsFree; // 调用者提供的 chunk 不需要 free
+    char data[] __attribute__((aligned(16)));
+};
+
+struct Block_arena {
+    struct Block_arena_chunk *chunks;   // 最新的 chunk 在最前面
+    char *bump;                         // 当前 chunk 中还没用的部分
+    char *end;
+    size_t chunkSize;
+    bool needsFree;                     // arena 本身是不是 malloc 出来的
+};
+
+// 在 arena 中切出一个 entry，返回 entry 后面的 payload 地址
+// 调用者：_Block_copy_in_arena()
+static void *_Block_arena_alloc(struct Block_arena *arena, size_t size, uint32_t kind) {
+    size_t entrySize = sizeof(struct Block_arena_entry) + BLOCK_ARENA_ALIGN(size);
+    
+    if (arena->bump + entrySize > arena->end) { // 当前 chunk 用完了
+        size_t chunkSize = arena->chunkSize;
+        if (entrySize > chunkSize) chunkSize = entrySize;
+        struct Block_arena_chunk *chunk = malloc(sizeof(struct Block_arena_chunk) + chunkSize);
+        if (!chunk) return NULL;
+        
+        if (arena->chunks) arena->chunks->top = arena->bump;
+        chunk->next = arena->chunks;
+        chunk->needsFree = true;
+        arena->chunks = chunk;
+        arena->bump = chunk->data;
+        arena->end = chunk->data + chunkSize;
+    }
+    
+    struct Block_arena_entry *entry = (struct Block_arena_entry *)arena->bump;
+    entry->size = (uint32_t)entrySize;
+    entry->kind = kind;
+    arena->bump += entrySize;
+    return entry + 1;
+}
+
+// 创建 arena。
+// buffer 不为 NULL 时，arena 本身和第一个 chunk 都放在调用者提供的这块内存中（比如请求对象中的一段），
+// 如果请求期间拷贝的 block 都放得下，就完全不需要 malloc。
+// size 是 buffer 的大小；buffer 为 NULL 时，是每个 chunk 的大小，0 表示使用默认值。
+Block_arena_t _Block_arena_create(void *buffer, size_t size) {
+    struct Block_arena *arena;
+    
+    if (buffer) {
+        // arena 头部之后剩下的空间作为第一个 chunk
+        size_t header = BLOCK_ARENA_ALIGN(sizeof(struct Block_arena)) + sizeof(struct Block_arena_chunk);
+        if (((uintptr_t)buffer & 15) || size < header) return NULL;
+        
+        arena = (struct Block_arena *)buffer;
+        struct Block_arena_chunk *chunk = (struct Block_arena_chunk *)((char *)buffer + BLOCK_ARENA_ALIGN(sizeof(struct Block_arena)));
+        chunk->next = NULL;
+        chunk->needsFree = false;
+        arena->chunks = chunk;
+        arena->bump = chunk->data;
+        arena->end = (char *)buffer + size;
+        arena->chunkSize = BLOCK_ARENA_DEFAULT_CHUNK_SIZE;
+        arena->needsFree = false;
+        return arena;
+    }
+    
+    arena = malloc(sizeof(struct Block_arena));
+    if (!arena) return NULL;
+    arena->chunks = NULL;
+    arena->bump = NULL;
+    arena->end = NULL;
+    arena->chunkSize = size ? size : BLOCK_ARENA_DEFAULT_CHUNK_SIZE;
+    arena->needsFree = true;
+    return arena;
+}
+
+// 把 block 拷贝到 arena 中，返回值归 arena 所有，不需要（也不能）对它调用 _Block_release。
+// 栈上的 block 会被拷贝进 arena，并调用 copy helper；
+// 堆上的 block 只是 retain 一次，arena 销毁时再 release；
+// 全局区的 block 和已经在 arena 中的 block 直接返回。
+void *_Block_copy_in_arena(const void *arg, Block_arena_t arena) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    if (!aBlock) return NULL;
+    
+    if (aBlock->flags & (BLOCK_IS_GLOBAL|BLOCK_IS_ARENA)) {
+        return aBlock;
+    }
+    
+    if (isGC || (aBlock->flags & (BLOCK_NEEDS_FREE|BLOCK_IS_GC))) {
+        // 已经在堆上了（或者是 GC），由 arena 持有一个引用
+        struct Block_layout **slot = _Block_arena_alloc(arena, sizeof(struct Block_layout *), BLOCK_ARENA_ENTRY_RETAIN);
+        if (!slot) return NULL;
+        *slot = _Block_copy_internal(aBlock, true, false);
+        return *slot;
+    }
+    
+    // 栈上的 block，拷贝到 arena 中，和 _Block_copy_internal() 中的非 GC 分支一样，只是不设引用计数
+    struct Block_layout *result = _Block_arena_alloc(arena, aBlock->descriptor->size, BLOCK_ARENA_ENTRY_COPY);
+    if (!result) return NULL;
+    _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
+    result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+    result->flags |= BLOCK_IS_ARENA;
+    result->reserved = 0;
+    result->isa = _NSConcreteMallocBlock;
+    _Block_copy_nested(result, aBlock, false);
+    return result;
+}
+
+// 销毁 arena：调用 arena 中所有 block 的 dispose helper，release 所有被 arena 持有的堆上的 block，
+// 然后释放所有 chunk。
+void _Block_arena_destroy(Block_arena_t arena) {
+    if (!arena) return;
+    if (arena->chunks) arena->chunks->top = arena->bump;
+    
+    struct Block_arena_chunk *chunk = arena->chunks;
+    while (chunk) {
+        char *cursor = chunk->data;
+        while (cursor < chunk->top) {
+            struct Block_arena_entry *entry = (struct Block_arena_entry *)cursor;
+            if (entry->kind == BLOCK_ARENA_ENTRY_COPY) {
+                struct Block_layout *aBlock = (struct Block_layout *)(entry + 1);
+                _Block_call_dispose_helper(aBlock);
+                _Block_callout_destructInstance(aBlock);
+            }
+            else {
+                _Block_release(*(struct Block_layout **)(entry + 1));
+            }
+            cursor += entry->size;
+        }
+        
+        struct Block_arena_chunk *next = chunk->next;
+        if (chunk->needsFree) free(chunk);
+        chunk = next;
+    }
+    
+    if (arena->needsFree) free(arena);
+}
+
+
+/************************************************************
+ *
+ * Small-buffer storage
+ *
+ ***********************************************************/
+
+// 把 block 放进 storage。
+// 栈上的 block 放得下时拷贝到 storage->buffer 中，和 _Block_copy_internal() 中的非 GC 分支一样
+// 调用 copy helper（嵌套的 block 同样走 worklist），但是不分配内存，也不设引用计数：
+// flags 保持栈上的样子，isa 仍然是 _NSConcreteStackBlock，
+// 这样别人对它 Block_copy 时会拷贝一份到堆上，而不是持有 storage 中的这一份。
+// 其他情况持有 _Block_copy_internal() 返回的引用。
+void _Block_storage_init(Block_storage_t *storage, const void *arg) {
+    struct Block_layout *aBlock = (struct Block_layout *)arg;
+    storage->reserved = NULL;
+
+    if (!aBlock || isGC
+        || (aBlock->flags & (BLOCK_NEEDS_FREE|BLOCK_IS_GC|BLOCK_IS_GLOBAL|BLOCK_IS_ARENA))
+        || aBlock->descriptor->size > sizeof(storage->buffer)) {
+        storage->block = _Block_copy_internal(aBlock, true, false);
+        return;
+    }
+
+    struct Block_layout *result = (struct Block_layout *)storage->buffer;
+    _Block_bitcopy(result, aBlock, aBlock->descriptor->size); // bitcopy first
+    result->flags &= ~(BLOCK_REFCOUNT_MASK|BLOCK_DEALLOCATING);
+    result->reserved = 0;
+    result->isa = _NSConcreteStackBlock;
+    _Block_copy_nested(result, aBlock, false);
+    storage->block = result;
+}
+
+// 返回一个堆上的引用。buffer 中的 block 先拷贝到堆上（调用 copy helper），然后销毁 buffer 中的这一份，
+// 之后 storage 持有堆上的 block。被引入的对象这样会多一次 retain/release，但是 C++ 对象和弱引用
+// 不能直接按位搬走，只能这么做。
+void *_Block_storage_share(Block_storage_t *storage) {
+    struct Block_layout *aBlock = (struct Block_layout *)storage->block;
+    if (aBlock != (struct Block_layout *)storage->buffer) {
+        return _Block_copy_internal(aBlock, true, false);
+    }
+
+    struct Block_layout *result = _Block_copy_internal(aBlock, true, false);
+    if (!result) return NULL;
+    _Block_storage_destroy(storage);
+    storage->block = result;
+    return _Block_copy_internal(result, true, false);
+}
+
+// 销毁 storage 中的 block。buffer 中的 block 像 arena 中的 block 一样只调用 dispose helper，不释放内存
+void _Block_storage_destroy(Block_storage_t *storage) {
+    struct Block_layout *aBlock = (struct Block_layout *)storage->block;
+    storage->block = NULL;
+    if (aBlock == (struct Block_layout *)storage->buffer) {
+        _Block_call_dispose_helper(aBlock);
+        _Block_callout_destructInstance(aBlock);
+    }
+    else if (aBlock) {
+        _Block_release(aBlock);
+    }
+}
+
+
+/************************************************************
+ *
+ * Forwarding-free byref access
+ *
+ ***********************************************************/
+
+// byref 被 _Block_byref_assign_copy() 拷贝到堆上以后，栈上的 forwarding 指向堆上的这一份，
+// 堆上的 forwarding 指向它自己，之后都不会再变。所以一旦看到 forwarding 指向的是堆上的 byref，
+// 调用者就可以记住这个地址，不用每次访问都经过 forwarding。
+void *_Block_byref_resolve(const void *arg) {
+    struct Block_byref *byref = (struct Block_byref *)arg;
+    if (!byref) return NULL;
+    struct Block_byref *resolved = byref->forwarding;
+    if (resolved->flags & (BLOCK_BYREF_NEEDS_FREE|BLOCK_BYREF_IS_GC)) {
+        return resolved;
+    }
+    return NULL; // 还在栈上，之后还可能被拷贝到堆上
+}
+
+
 /************************************************************
  *
  * SPI used by other layers
@@ -734,7 +2999,7 @@ static void _Block_destroy(const void *arg) {
 // SPI, also internal.  Called from NSAutoBlock only under GC
 // 只在 GC 下有用，不用管
 void *_Block_copy_collectable(const void *aBlock) {
-    return _Block_copy_internal(aBlock, false);
+    return _Block_copy_internal(aBlock, false, false);
 }
 
 
@@ -762,6 +3027,14 @@ bool _Block_has_signature(void *aBlock) {
 // 取得 block 的签名字符串，可能是 NULL
 const char * _Block_signature(void *aBlock)
 {
+#if BLOCK_COPY_PLANS
+    // 有 plan 的话，签名已经在 plan 中了
+    if (((struct Block_layout *)aBlock)->flags & BLOCK_HAS_SIGNATURE) {
+        struct Block_plan *plan = _Block_plan_for(aBlock);
+        if (plan) return plan->signature;
+    }
+#endif
+
     // 取得 Block_descriptor_3，签名在其中
     struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
     if (!desc3) return NULL; // 如果没有 desc3，则一定没有签名，返回 NULL
@@ -777,6 +3050,13 @@ const char * _Block_layout(void *aBlock)
     struct Block_layout *layout = (struct Block_layout *)aBlock;
     if (layout->flags & BLOCK_HAS_EXTENDED_LAYOUT) return NULL;
 
+#if BLOCK_COPY_PLANS
+    if (layout->flags & BLOCK_HAS_SIGNATURE) {
+        struct Block_plan *plan = _Block_plan_for(layout);
+        if (plan) return plan->layout;
+    }
+#endif
+
     // 如果没有 Block_descriptor_3，也返回 NULL
     struct Block_descriptor_3 *desc3 = _Block_descriptor_3(aBlock);
     if (!desc3) return NULL;
@@ -806,6 +3086,23 @@ const char * _Block_extended_layout(void *aBlock)
     }
 }
 
+// 取得 block 或 byref heap 的统计数据
+void _Block_get_heap_statistics(int heap, Block_heap_statistics *stats) {
+    size_t size = stats->size;
+    memset(stats, 0, size);
+    stats->size = size;
+#if BLOCK_SLAB_ALLOCATOR
+    if (heap == BLOCK_HEAP_BLOCKS) {
+        _Block_slab_statistics(&_Block_block_heap, stats);
+    }
+    else if (heap == BLOCK_HEAP_BYREFS) {
+        _Block_slab_statistics(&_Block_byref_heap, stats);
+    }
+#else
+    (void)heap;
+#endif
+}
+
 #if !TARGET_OS_WIN32
 #pragma mark - Compiler SPI entry points
 #endif
@@ -885,10 +3182,10 @@ void _Block_object_assign(void *destAddr, const void *object, const int flags) {
         ********/
         // 非 GC 下的 _Block_retain_object 默认什么都不干，但在 _Block_use_RR() 中会被 Objc runtime 或者 CoreFoundation 设置 retain 函数，
         // 其中，可能会与 runtime 建立联系，操作对象的引用计数什么的
-        _Block_retain_object(object);
+        _Block_callout_retain_object(object);
             
         // 非 GC 下的 _Block_assign 只是使 destAddr 指向的目标指针指向 object
-        _Block_assign((void *)object, destAddr);
+        _Block_callout_assign((void *)object, destAddr);
         break;
 
       case BLOCK_FIELD_IS_BLOCK: // 如果是 block
@@ -898,7 +3195,7 @@ void _Block_object_assign(void *destAddr, const void *object, const int flags) {
         ********/
         
         // 先用 _Block_copy_internal 将 block 拷贝到堆上，如果原来就在堆上，则引用计数加 1。再进行 assign。
-        _Block_assign(_Block_copy_internal(object, false), destAddr);
+        _Block_callout_assign(_Block_copy_internal(object, false, true), destAddr);
         break;
     
       case BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK: // 如果是 byref
@@ -925,7 +3222,7 @@ void _Block_object_assign(void *destAddr, const void *object, const int flags) {
 
         // under manual retain release __block object/block variables are dangling(悬挂的)
         // 这里没有进行堆拷贝，直接进行 assign 了
-        _Block_assign((void *)object, destAddr);
+        _Block_callout_assign((void *)object, destAddr);
         break;
 
       case BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT | BLOCK_FIELD_IS_WEAK: // 如果是被 __weak 修饰的 __block 对象和block
@@ -938,7 +3235,7 @@ void _Block_object_assign(void *destAddr, const void *object, const int flags) {
          ********/
 
         // 在非 GC 下，_Block_assign_weak 和 _Block_assign 好像没什么区别
-        _Block_assign_weak(object, destAddr);
+        _Block_callout_assign_weak(object, destAddr);
         break;
 
       default:
@@ -964,7 +3261,7 @@ void _Block_object_dispose(const void *object, const int flags) {
         break;
             
       case BLOCK_FIELD_IS_OBJECT: // 如果是对象
-        _Block_release_object(object); // 默认啥也不干，但在 _Block_use_RR() 中可能会被 Objc runtime 或者 CoreFoundation 设置一个 release 函数，里面可能会涉及到 runtime 的引用计数
+        _Block_callout_release_object(object); // 默认啥也不干，但在 _Block_use_RR() 中可能会被 Objc runtime 或者 CoreFoundation 设置一个 release 函数，里面可能会涉及到 runtime 的引用计数
         break;
             
       // 下面的这些，都有 BLOCK_BYREF_CALLER，则什么也不干
@@ -977,3 +3274,55 @@ void _Block_object_dispose(const void *object, const int flags) {
         break;
     }
 }
+
+
+// Flag-specialized entry points.
+// 编译器生成的 helper 传的 flags 都是常量，这些入口分别对应上面 switch 中的一个 case，
+// 调用者已经知道是哪种情况了，就不用再解码 flags。头文件中的 _Block_object_assign_inline() /
+// _Block_object_dispose_inline() 在 flags 是编译时常量时直接调用它们
+
+// BLOCK_FIELD_IS_OBJECT
+void _Block_object_assign_object(void *destAddr, const void *object) {
+    _Block_callout_retain_object(object);
+    _Block_callout_assign((void *)object, (void **)destAddr);
+}
+
+// BLOCK_FIELD_IS_BLOCK
+void _Block_object_assign_block(void *destAddr, const void *object) {
+    _Block_callout_assign(_Block_copy_internal(object, false, true), (void **)destAddr);
+}
+
+// BLOCK_FIELD_IS_BYREF
+void _Block_object_assign_byref(void *destAddr, const void *object) {
+    _Block_byref_assign_copy(destAddr, object, BLOCK_FIELD_IS_BYREF);
+}
+
+// BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK
+void _Block_object_assign_weak_byref(void *destAddr, const void *object) {
+    _Block_byref_assign_copy(destAddr, object, BLOCK_FIELD_IS_BYREF | BLOCK_FIELD_IS_WEAK);
+}
+
+// BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT 和 BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK
+void _Block_object_assign_byref_field(void *destAddr, const void *object) {
+    _Block_callout_assign((void *)object, (void **)destAddr);
+}
+
+// BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_OBJECT | BLOCK_FIELD_IS_WEAK 和 BLOCK_BYREF_CALLER | BLOCK_FIELD_IS_BLOCK | BLOCK_FIELD_IS_WEAK
+void _Block_object_assign_weak_byref_field(void *destAddr, const void *object) {
+    _Block_callout_assign_weak(object, destAddr);
+}
+
+// BLOCK_FIELD_IS_OBJECT
+void _Block_object_dispose_object(const void *object) {
+    _Block_callout_release_object(object);
+}
+
+// BLOCK_FIELD_IS_BLOCK
+void _Block_object_dispose_block(const void *object) {
+    _Block_destroy(object);
+}
+
+// BLOCK_FIELD_IS_BYREF，有没有 BLOCK_FIELD_IS_WEAK 都一样
+void _Block_object_dispose_byref(const void *object) {
+    _Block_byref_release(object);
+}